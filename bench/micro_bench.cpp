@@ -0,0 +1,270 @@
+// Micro-benchmarks of the math, intersection and shading kernels, to check
+// kernel-level optimizations in isolation from whole-frame timings.
+//
+//   make bench && ./micro_bench [--filter <substring>] [--samples <n>]
+//                               [--json <file>]
+//
+// Every benchmark is warmed up, then timed over `samples` batches of as
+// many calls as fit in ~2 ms; the reported numbers are ns per call.
+#include "camera.hpp"
+#include "fresnel.hpp"
+#include "light.hpp"
+#include "linear_accel.hpp"
+#include "mat3x3.hpp"
+#include "objects.hpp"
+#include "ray.hpp"
+#include "ray_tracer.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Bench {
+
+// makes the compiler assume `value` is read, so the computation
+// producing it can't be removed as dead code
+template <typename T>
+inline void DoNotOptimize(const T& value) {
+  asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct Options {
+  std::string filter;      // run the benchmarks whose name contains it
+  int samples{51};         // timed batches
+  double warmup_ns{50e6};  // untimed runs before the samples
+  double batch_ns{2e6};    // target duration of a batch
+  std::string json_path;   // empty - no JSON
+};
+
+struct Result {
+  std::string name;
+  size_t batch{0}; // calls per sample
+  int samples{0};
+  // ns per call over the samples
+  double min{0}, p10{0}, median{0}, p90{0}, p99{0}, mean{0};
+};
+
+// linear interpolation between the closest ranks of sorted samples
+inline double Percentile(const std::vector<double>& sorted, double p) {
+  double rank = p * (sorted.size() - 1);
+  size_t lo = static_cast<size_t>(rank);
+  size_t hi = std::min(lo + 1, sorted.size() - 1);
+  return sorted[lo] + (sorted[hi] - sorted[lo]) * (rank - lo);
+}
+
+class Suite {
+public:
+  explicit Suite(const Options& options) : options_(options) {}
+
+  // time op(i) for i = 0, 1, 2, ... - op picks its inputs by i
+  template <typename Op>
+  void Run(const std::string& name, Op op) {
+    if (name.find(options_.filter) == std::string::npos) return;
+    using Clock = std::chrono::steady_clock;
+    auto time_batch = [&op](size_t calls) {
+      auto t0 = Clock::now();
+      for (size_t i = 0; i < calls; ++i) op(i);
+      return std::chrono::duration<double, std::nano>(Clock::now() - t0)
+          .count();
+    };
+    // grow the batch until it takes batch_ns - this warms up as well
+    size_t batch = 1;
+    double spent = 0;
+    for (double ns = time_batch(batch);
+         ns < options_.batch_ns && batch < (size_t{1} << 32);
+         ns = time_batch(batch)) {
+      spent += ns;
+      batch *= 2;
+    }
+    while (spent < options_.warmup_ns) spent += time_batch(batch);
+
+    std::vector<double> per_call(options_.samples);
+    for (auto& sample : per_call) sample = time_batch(batch) / batch;
+    std::sort(per_call.begin(), per_call.end());
+    Result ret{.name = name, .batch = batch, .samples = options_.samples};
+    ret.min = per_call.front();
+    ret.p10 = Percentile(per_call, 0.10);
+    ret.median = Percentile(per_call, 0.50);
+    ret.p90 = Percentile(per_call, 0.90);
+    ret.p99 = Percentile(per_call, 0.99);
+    for (double sample : per_call) ret.mean += sample / per_call.size();
+    Print(ret);
+    results_.push_back(ret);
+  }
+
+  void WriteJson(const std::string& path) const {
+    std::ofstream out(path);
+    if (!out)
+      throw std::runtime_error("ERROR: cannot open " + path);
+    out << "{\n  \"context\": {\"compiler\": \"" << __VERSION__
+        << "\", \"samples\": " << options_.samples
+        << ", \"unit\": \"ns\"},\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results_.size(); ++i) {
+      const auto& r = results_[i];
+      out << "    {\"name\": \"" << r.name << "\", \"batch\": " << r.batch
+          << ", \"samples\": " << r.samples << ", \"min\": " << r.min
+          << ", \"p10\": " << r.p10 << ", \"median\": " << r.median
+          << ", \"p90\": " << r.p90 << ", \"p99\": " << r.p99
+          << ", \"mean\": " << r.mean << "}"
+          << (i + 1 < results_.size() ? ",\n" : "\n");
+    }
+    out << "  ]\n}\n";
+  }
+
+private:
+  static void Print(const Result& r) {
+    std::printf("%-34s %10.2f %10.2f %10.2f %10.2f  x%zu\n", r.name.c_str(),
+                r.median, r.p10, r.p90, r.p99, r.batch);
+  }
+
+  Options options_;
+  std::vector<Result> results_;
+};
+
+} // namespace Bench
+
+// a power of 2 so inputs are picked by i & (kInputs - 1)
+constexpr size_t kInputs = 1024;
+constexpr size_t kMask = kInputs - 1;
+
+int main(int argc, char** argv) {
+  Bench::Options options;
+  for (int i = 1; i < argc; i += 2) {
+    std::string arg = argv[i];
+    if (i + 1 < argc && arg == "--filter") {
+      options.filter = argv[i + 1];
+    } else if (i + 1 < argc && arg == "--samples") {
+      options.samples = std::max(1, std::atoi(argv[i + 1]));
+    } else if (i + 1 < argc && arg == "--json") {
+      options.json_path = argv[i + 1];
+    } else {
+      std::cerr << "usage: " << argv[0]
+                << " [--filter <substring>] [--samples <n>] [--json <file>]\n";
+      return 1;
+    }
+  }
+
+  // random inputs, the same on every run; the kernels cycle through them
+  // so the compiler can't fold them into constants
+  std::mt19937 rng(7);
+  std::uniform_real_distribution<float> unif(-1.0f, 1.0f);
+  auto random_vec = [&]() { return Vec3f{unif(rng), unif(rng), unif(rng)}; };
+  std::vector<Vec3f> a(kInputs), b(kInputs);
+  std::vector<float> angles(kInputs), cosines(kInputs);
+  std::vector<Mat3x3> mats(kInputs);
+  for (size_t i = 0; i < kInputs; ++i) {
+    a[i] = random_vec();
+    b[i] = random_vec();
+    angles[i] = unif(rng) * 3.14159265f;
+    cosines[i] = std::abs(unif(rng));
+    mats[i] = Mat3x3(unif(rng), unif(rng), unif(rng));
+  }
+
+  // rays from the origin towards a unit sphere 10 units away - either
+  // through its inner half or well to its side
+  Sphere target;
+  target.center = {0, 0, 10};
+  target.radius = 1;
+  std::vector<Ray> hit_rays, miss_rays;
+  for (size_t i = 0; i < kInputs; ++i) {
+    Vec3f offset{unif(rng) * 0.35f, unif(rng) * 0.35f, 0};
+    hit_rays.emplace_back(Vec3f{0, 0, 0}, target.center + offset);
+    miss_rays.emplace_back(Vec3f{0, 0, 0},
+                           target.center + offset + Vec3f{2.5f, 0, 0});
+  }
+
+  // shading: 4 lights and 8 spheres, points on the camera-facing side of
+  // the first sphere
+  Camera camera(100, 90, 90);
+  Lights lights;
+  lights.AddAmbient(0.2);
+  lights.AddDir(0.3, -0.5, 1, -0.4);
+  lights.AddDir(0.2, 0.6, 0.8, -0.2);
+  lights.AddPoint(0.4, -20, 30, -10);
+  lights.AddPoint(0.3, 25, 10, -5);
+  std::vector<Sphere> spheres;
+  for (int i = 0; i < 8; ++i) {
+    Sphere s;
+    s.center = {(i % 4) * 6.0f - 9, (i / 4) * 6.0f - 3, 30.0f + i};
+    s.radius = 2;
+    s.material.specular = 20;
+    spheres.push_back(s);
+  }
+  LinearAccel scene(spheres);
+  lights.Normalize();
+  lights.Prepare(scene);
+  std::vector<Vec3f> surface(kInputs);
+  for (auto& at : surface) {
+    Vec3f dir = random_vec();
+    dir.z = -std::abs(dir.z) - 0.1f;
+    at = spheres[0].center + dir.Unit() * spheres[0].radius;
+  }
+  RayTracer ray_tracer(camera, lights);
+
+  using Bench::DoNotOptimize;
+  Bench::Suite suite(options);
+  std::printf("%-34s %10s %10s %10s %10s  %s\n", "ns per call", "median",
+              "p10", "p90", "p99", "batch");
+
+  suite.Run("Xyz<float>::Dot", [&](size_t i) {
+    DoNotOptimize(a[i & kMask].Dot(b[i & kMask]));
+  });
+  suite.Run("Xyz<float>::Unit", [&](size_t i) {
+    DoNotOptimize(a[i & kMask].Unit());
+  });
+  suite.Run("Xyz<float>::Cross", [&](size_t i) {
+    DoNotOptimize(a[i & kMask].Cross(b[i & kMask]));
+  });
+  suite.Run("Xyz<float>::ReflectAbout", [&](size_t i) {
+    DoNotOptimize(a[i & kMask].ReflectAbout(b[i & kMask]));
+  });
+  suite.Run("Mat3x3::operator*(Vec3f)", [&](size_t i) {
+    DoNotOptimize(mats[i & kMask] * a[i & kMask]);
+  });
+  suite.Run("Mat3x3::operator*(Mat3x3)", [&](size_t i) {
+    DoNotOptimize(mats[i & kMask] * mats[(i + 1) & kMask]);
+  });
+  suite.Run("Mat3x3::RotateX", [&](size_t i) {
+    Mat3x3 m = mats[i & kMask];
+    m.RotateX(angles[i & kMask]);
+    DoNotOptimize(m);
+  });
+  suite.Run("Mat3x3::RotateY", [&](size_t i) {
+    Mat3x3 m = mats[i & kMask];
+    m.RotateY(angles[i & kMask]);
+    DoNotOptimize(m);
+  });
+  suite.Run("Mat3x3::RotateZ", [&](size_t i) {
+    Mat3x3 m = mats[i & kMask];
+    m.RotateZ(angles[i & kMask]);
+    DoNotOptimize(m);
+  });
+  suite.Run("Sphere::Intersects/hit", [&](size_t i) {
+    DoNotOptimize(target.Intersects(hit_rays[i & kMask]));
+  });
+  suite.Run("Sphere::Intersects/miss", [&](size_t i) {
+    DoNotOptimize(target.Intersects(miss_rays[i & kMask]));
+  });
+  for (auto mode : {MathMode::PRECISE, MathMode::FAST}) {
+    const std::string suffix = mode == MathMode::FAST ? "/fast" : "/precise";
+    ray_tracer.SetMathMode(mode);
+    suite.Run("Lights::ColorAt" + suffix, [&](size_t i) {
+      DoNotOptimize(lights.ColorAt(scene, spheres[0], 0, surface[i & kMask],
+                                   camera));
+    });
+    suite.Run("Schlick" + suffix, [&](size_t i) {
+      DoNotOptimize(Schlick(1.0f, 1.5f, cosines[i & kMask], mode));
+    });
+  }
+
+  if (!options.json_path.empty())
+    suite.WriteJson(options.json_path);
+}
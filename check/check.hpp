@@ -0,0 +1,92 @@
+#ifndef CHECK_HPP_
+#define CHECK_HPP_
+
+// helpers shared by the checks that `make check` runs (see main.cpp)
+#include "light.hpp"
+#include "ray_tracer.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace Check {
+
+inline int failures = 0;
+
+inline void Expect(bool ok, const std::string& name, double value,
+                   double limit) {
+  std::printf("%-4s %-52s %12.4g  (limit %g)\n", ok ? "ok" : "FAIL",
+              name.c_str(), value, limit);
+  if (!ok) ++failures;
+}
+
+// largest difference of a channel between two frames of the same size
+inline int MaxLevelDiff(const Image& a, const Image& b) {
+  int ret = 0;
+  for (size_t i = 0; i < a.data.size(); ++i)
+    for (int c = 0; c < 3; ++c)
+      ret = std::max(ret, std::abs(a.data[i].xyz[c] - b.data[i].xyz[c]));
+  return ret;
+}
+
+// the spheres and lights of the demo
+inline void AddDemoLights(Lights& lights) {
+  lights.AddAmbient(0.65);
+  lights.AddDir(0.6, -0.1, -0.2, 0.3);
+  lights.AddPoint(0.4, -800, 200, -800);
+  lights.AddPoint(0.3, 600, -400, -1000);
+  lights.AddPoint(0.3, -200, 400, 1000);
+  lights.AddDir(0.6, 0.3, -0.1, -0.3);
+}
+
+inline void AddDemoScene(RayTracer& ray_tracer, Lights& lights) {
+  Sphere s1, s2, s3, s4, s5, s6;
+  s1.center = {0, 0, 2000};
+  s1.material.color = {255, 0, 0};
+  s1.radius = 400;
+  s1.material.specular = 150;
+  s1.material.reflective = 0.7;
+  s1.material.tint = 0.1f;
+  s2.center = {-600, -200, 1500};
+  s2.material.color = {0, 255, 0};
+  s2.radius = 300;
+  s2.material.specular = 5;
+  s2.material.reflective = 0.25;
+  s3.center = {500, 100, 1200};
+  s3.radius = 250;
+  s3.material.specular = 20;
+  s3.material.reflective = 0.3f;
+  s3.material.transparency = 0.5;
+  s4.center = {-300, 400, 2000};
+  s4.material.color = {255, 255, 0};
+  s4.radius = 250;
+  s4.material.specular = 20;
+  s4.material.reflective = 0.7f;
+  s4.material.transparency = 0.4f;
+  s4.material.refractive_index = 1.4f;
+  s4.material.tint = 0.3;
+  s5.center = {400, -300, 1600};
+  s5.material.color = {200, 0, 200};
+  s5.radius = 200;
+  s5.material.specular = 20;
+  s5.material.reflective = 0.4;
+  s5.material.transparency = 0.7f;
+  s5.material.refractive_index = 1.5f;
+  s6.center = {0, 4400, 2200};
+  s6.material.color = {180, 190, 200};
+  s6.radius = 3200;
+  s6.material.specular = 80;
+  for (const auto& s : {s1, s2, s3, s4, s5, s6})
+    ray_tracer.AddObject(s);
+  AddDemoLights(lights);
+}
+
+// the checks, one file each
+void RunFastMath();
+void RunIncremental();
+void RunVariableRate();
+
+} // namespace Check
+
+#endif // CHECK_HPP_
@@ -0,0 +1,109 @@
+// Checks that MathMode::FAST stays within its documented error: the
+// approximations of fast_math.hpp against <cmath> in double precision, and
+// a frame rendered in FAST mode against the same frame in PRECISE mode.
+#include "camera.hpp"
+#include "check.hpp"
+#include "fast_math.hpp"
+#include <cmath>
+#include <functional>
+#include <random>
+
+namespace Check {
+
+namespace {
+
+// an approximation and the function it approximates, with the maximum
+// error documented for it over [lo, hi]
+struct Case {
+  std::string name;
+  std::function<float(float)> approx;
+  std::function<double(double)> exact;
+  float lo, hi;
+  bool log_scale; // sample x log-uniformly - for ranges over many octaves
+  bool absolute;  // absolute instead of relative error
+  double limit;
+};
+
+// largest error over random x in [lo, hi]
+double MaxError(const Case& c, int n = 1 << 20) {
+  std::mt19937 rng(3);
+  std::uniform_real_distribution<double> unif(0.0, 1.0);
+  double ret = 0;
+  for (int i = 0; i < n; ++i) {
+    double u = unif(rng);
+    float x = static_cast<float>(
+        c.log_scale ? c.lo * std::pow(double{c.hi} / c.lo, u)
+                    : c.lo + (double{c.hi} - c.lo) * u);
+    double want = c.exact(x);
+    double err = std::abs(c.approx(x) - want);
+    ret = std::max(ret, c.absolute ? err : err / std::abs(want));
+  }
+  return ret;
+}
+
+} // namespace
+
+void RunFastMath() {
+  // the maxima documented in fast_math.hpp
+  const Case cases[] = {
+      {"FastMath::PowInt<5> relative error",
+       [](float x) { return FastMath::PowInt<5>(x); },
+       [](double x) { return std::pow(x, 5); }, 1e-3f, 1.0f, true, false,
+       2.3e-7},
+      {"FastMath::Log2 absolute error near 1", FastMath::Log2,
+       [](double x) { return std::log2(x); }, 0.5f, 2.0f, false, true,
+       1.4e-7},
+      {"FastMath::Log2 relative error below 1/2", FastMath::Log2,
+       [](double x) { return std::log2(x); }, 1e-30f, 0.5f, true, false,
+       1e-7},
+      {"FastMath::Log2 relative error above 2", FastMath::Log2,
+       [](double x) { return std::log2(x); }, 2.0f, 1e30f, true, false,
+       1e-7},
+      {"FastMath::Exp2 relative error", FastMath::Exp2,
+       [](double x) { return std::exp2(x); }, -126.0f, 127.0f, false, false,
+       2.5e-7},
+      // the largest specular exponent of the demo scene, for x where x^150
+      // is still a normal float
+      {"FastMath::Pow(x, 150) relative error",
+       [](float x) { return FastMath::Pow(x, 150.0f); },
+       [](double x) { return std::pow(x, 150.0); }, 0.6f, 1.0f, false, false,
+       7e-7 * 150},
+      {"FastMath::Rsqrt relative error", FastMath::Rsqrt,
+       [](double x) { return 1.0 / std::sqrt(x); }, 1e-30f, 1e30f, true,
+       false, 4.8e-6},
+  };
+  for (const auto& c : cases) {
+    double err = MaxError(c);
+    Expect(err <= c.limit, c.name, err, c.limit);
+  }
+
+  // the demo frame in both modes; shading errors of ~1e-6 may still
+  // round a channel to the neighbouring level
+  constexpr double max_level_diff = 1;
+  Image frames[2] = {Image(1, 1), Image(1, 1)};
+  for (auto mode : {MathMode::PRECISE, MathMode::FAST}) {
+    Camera camera(400, 100, 80, {0, 0, -200}, {0.2, -0.2, 0.4});
+    Lights lights;
+    RayTracer ray_tracer(camera, lights);
+    AddDemoScene(ray_tracer, lights);
+    ray_tracer.SetMathMode(mode);
+    ray_tracer.Trace(5);
+    frames[mode == MathMode::FAST] = ray_tracer.image();
+  }
+  int max_diff = 0;
+  double sum_diff = 0;
+  const auto& precise = frames[0].data;
+  const auto& fast = frames[1].data;
+  for (size_t i = 0; i < precise.size(); ++i)
+    for (int c = 0; c < 3; ++c) {
+      int diff = std::abs(precise[i].xyz[c] - fast[i].xyz[c]);
+      max_diff = std::max(max_diff, diff);
+      sum_diff += diff;
+    }
+  Expect(max_diff <= max_level_diff, "FAST vs PRECISE frame, max level diff",
+         max_diff, max_level_diff);
+  std::printf("     mean level diff %.3g over %zu channels\n",
+              sum_diff / (3 * precise.size()), 3 * precise.size());
+}
+
+} // namespace Check
@@ -0,0 +1,142 @@
+// Checks that TraceIncremental after random scene edits renders the same
+// frame as a full Trace of the edited scene - also while the cost map and
+// G-buffer capture are switched on and off between frames.
+#include "camera.hpp"
+#include "check.hpp"
+#include <random>
+#include <stdexcept>
+
+namespace Check {
+
+namespace {
+
+// random edits in front of the camera
+class Editor {
+public:
+  explicit Editor(RayTracer& ray_tracer) : ray_tracer_(ray_tracer) {}
+
+  void Edit() {
+    const auto nobjects = ray_tracer_.objects().size();
+    ObjectId id = std::uniform_int_distribution<ObjectId>(
+        0, static_cast<ObjectId>(nobjects - 1))(rng_);
+    switch (std::uniform_int_distribution<int>(0, 3)(rng_)) {
+      case 0: {
+        Sphere s = ray_tracer_.objects()[id];
+        s.center = s.center + Vec3f{Unif(-200, 200), Unif(-200, 200),
+                                    Unif(-200, 200)};
+        ray_tracer_.EditObject(id, s);
+        break;
+      }
+      case 1: {
+        Sphere s = ray_tracer_.objects()[id];
+        s.radius = std::max(20.0f, s.radius * Unif(0.7f, 1.3f));
+        ray_tracer_.EditObject(id, s);
+        break;
+      }
+      case 2: {
+        Material& m = ray_tracer_.material(id);
+        m.color = {static_cast<uint8_t>(Unif(0, 255)),
+                   static_cast<uint8_t>(Unif(0, 255)),
+                   static_cast<uint8_t>(Unif(0, 255))};
+        m.reflective = Unif(0, 0.8f);
+        m.specular = Unif(0, 100);
+        break;
+      }
+      case 3: {
+        Sphere s;
+        s.center = {Unif(-800, 800), Unif(-500, 500), Unif(1000, 2500)};
+        s.radius = Unif(50, 300);
+        s.material.color = {0, 128, 255};
+        s.material.reflective = Unif(0, 0.6f);
+        s.material.transparency = Unif(0, 1) < 0.3f ? 0.5f : 0.0f;
+        s.material.refractive_index = 1.3f;
+        ray_tracer_.AddObject(s);
+        break;
+      }
+    }
+  }
+  float Unif(float lo, float hi) {
+    return std::uniform_real_distribution<float>(lo, hi)(rng_);
+  }
+
+private:
+  RayTracer& ray_tracer_;
+  std::mt19937 rng_{11};
+};
+
+} // namespace
+
+void RunIncremental() {
+  constexpr int frames = 16;
+  // the tracers keep a reference to it
+  const Camera camera(120, 100, 80, {0, 0, -200}, {0.2, -0.2, 0.4});
+  Lights lights;
+  RayTracer ray_tracer(camera, lights);
+  AddDemoScene(ray_tracer, lights);
+  ray_tracer.TrackDependencies();
+  ray_tracer.Trace(3);
+  Editor editor(ray_tracer);
+  int max_diff = 0, gbuffer_diffs = 0, cost_diffs = 0, partial = 0;
+  for (int frame = 0; frame < frames; ++frame) {
+    const int nedits = 1 + frame % 3;
+    for (int e = 0; e < nedits; ++e) editor.Edit();
+    // switched at some frames only, so most of them stay incremental
+    const bool cost_map = frame % 8 >= 4;
+    const bool gbuffer = frame % 6 >= 3;
+    if (cost_map)
+      ray_tracer.EnableCostMap(CostMetric::RAYS);
+    else
+      ray_tracer.DisableCostMap();
+    ray_tracer.CaptureGBuffer(gbuffer);
+    ray_tracer.TraceIncremental(3);
+    partial += !ray_tracer.incremental_stats().full;
+
+    Lights fresh_lights;
+    AddDemoLights(fresh_lights);
+    RayTracer fresh(camera, fresh_lights);
+    for (const auto& obj : ray_tracer.objects()) fresh.AddObject(obj);
+    if (cost_map) fresh.EnableCostMap(CostMetric::RAYS);
+    fresh.CaptureGBuffer(gbuffer);
+    fresh.Trace(3);
+    max_diff = std::max(max_diff,
+                        MaxLevelDiff(ray_tracer.image(), fresh.image()));
+    if (gbuffer) {
+      const auto& a = ray_tracer.gbuffer().data;
+      const auto& b = fresh.gbuffer().data;
+      for (size_t i = 0; i < a.size(); ++i)
+        gbuffer_diffs += a[i].id != b[i].id || !(a[i].albedo == b[i].albedo);
+    }
+    if (cost_map) {
+      const auto& a = ray_tracer.cost_map().data;
+      const auto& b = fresh.cost_map().data;
+      for (size_t i = 0; i < a.size(); ++i) cost_diffs += a[i] != b[i];
+    }
+  }
+  Expect(max_diff == 0, "TraceIncremental vs Trace, max level diff",
+         max_diff, 0);
+  Expect(gbuffer_diffs == 0, "TraceIncremental vs Trace, G-buffer diffs",
+         gbuffer_diffs, 0);
+  Expect(cost_diffs == 0, "TraceIncremental vs Trace, cost map diffs",
+         cost_diffs, 0);
+  // else the check only compared full traces
+  Expect(partial >= frames / 2, "TraceIncremental frames not re-traced fully",
+         partial, frames / 2);
+
+  // edits of objects an accelerator traces copies of can't be tracked
+  ray_tracer.SetAccelerator(std::make_shared<LinearAccel>(
+      ray_tracer.objects()));
+  int rejected = 0;
+  try {
+    ray_tracer.EditObject(0, ray_tracer.objects()[0]);
+  } catch (const std::runtime_error&) {
+    ++rejected;
+  }
+  try {
+    ray_tracer.material(0);
+  } catch (const std::runtime_error&) {
+    ++rejected;
+  }
+  Expect(rejected == 2, "edits rejected with an accelerator set", rejected, 2);
+}
+
+} // namespace Check
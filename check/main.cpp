@@ -0,0 +1,21 @@
+// Checks of the approximations and shortcuts of the renderer against the
+// exact code paths:
+//
+//   make check
+//
+// Exits with 1 if any check fails.
+#include "check.hpp"
+#include <cstdio>
+
+int main() {
+  Check::RunFastMath();
+  Check::RunIncremental();
+  Check::RunVariableRate();
+
+  if (Check::failures) {
+    std::printf("%d check(s) failed\n", Check::failures);
+    return 1;
+  }
+  std::printf("all checks passed\n");
+  return 0;
+}
@@ -0,0 +1,49 @@
+// Checks that variable-rate shading stays close to the frame traced at
+// full rate, for both patterns and block sizes at a few resolutions.
+#include "camera.hpp"
+#include "check.hpp"
+#include <string>
+
+namespace Check {
+
+void RunVariableRate() {
+  // a little over max_color_diff - reconstructed pixels are interpolated
+  // between probes up to that far apart
+  constexpr int max_level_diff = 12;
+  constexpr double max_mean_diff = 0.1;
+  for (float focal_length : {3.0f, 25.0f, 50.0f, 200.0f}) {
+    const Camera camera(focal_length, 100, 80, {0, 0, -200},
+                        {0.2, -0.2, 0.4});
+    Lights lights;
+    RayTracer ray_tracer(camera, lights);
+    AddDemoScene(ray_tracer, lights);
+    ray_tracer.Trace(5);
+    const Image full = ray_tracer.image();
+    for (int block : {2, 4}) {
+      for (auto pattern : {RatePattern::CHECKERBOARD, RatePattern::BLOCKS}) {
+        ray_tracer.SetVariableRate(
+            VariableRate{.block = block, .pattern = pattern});
+        ray_tracer.Trace(5);
+        const Image image = ray_tracer.image();
+        int max_diff = 0;
+        double sum_diff = 0;
+        for (size_t i = 0; i < full.data.size(); ++i) {
+          int diff = MaxChannelDiff(full.data[i], image.data[i]);
+          max_diff = std::max(max_diff, diff);
+          sum_diff += diff;
+        }
+        const double mean_diff = sum_diff / full.data.size();
+        const std::string name =
+            "variable rate " + std::to_string(full.width) + "x" +
+            std::to_string(full.height) + " " + std::to_string(block) +
+            (pattern == RatePattern::BLOCKS ? " blocks" : " checkerboard");
+        Expect(max_diff <= max_level_diff, name + ", max level diff",
+               max_diff, max_level_diff);
+        Expect(mean_diff <= max_mean_diff, name + ", mean level diff",
+               mean_diff, max_mean_diff);
+      }
+    }
+  }
+}
+
+} // namespace Check
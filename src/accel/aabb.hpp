@@ -0,0 +1,63 @@
+#ifndef AABB_HPP_
+#define AABB_HPP_
+
+#include "objects.hpp"
+#include "ray.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <limits> // numeric_limits
+
+// axis-aligned bounding box
+struct Aabb {
+  Vec3f min{std::numeric_limits<float>::infinity()};
+  Vec3f max{-std::numeric_limits<float>::infinity()};
+
+  void Expand(const Vec3f& p) {
+    for (int i = 0; i < 3; ++i) {
+      min.xyz[i] = std::min(min.xyz[i], p.xyz[i]);
+      max.xyz[i] = std::max(max.xyz[i], p.xyz[i]);
+    }
+  }
+  void Expand(const Aabb& other) {
+    Expand(other.min);
+    Expand(other.max);
+  }
+  bool Empty() const { return min.x > max.x; }
+  bool Contains(const Vec3f& p) const {
+    return p.x >= min.x && p.x <= max.x && p.y >= min.y && p.y <= max.y &&
+           p.z >= min.z && p.z <= max.z;
+  }
+
+  // slab test - on a hit t_enter is where the ray enters the box (0 if
+  // it starts inside) and t_exit where it leaves it
+  bool Intersects(const Ray& ray, float t_max, float& t_enter,
+                  float& t_exit) const {
+    float t0 = 0.0f, t1 = t_max;
+    for (int i = 0; i < 3; ++i) {
+      float inv = 1.0f / ray.dir.xyz[i];
+      float near = (min.xyz[i] - ray.origin.xyz[i]) * inv;
+      float far = (max.xyz[i] - ray.origin.xyz[i]) * inv;
+      if (near > far) std::swap(near, far);
+      t0 = std::max(t0, near);
+      t1 = std::min(t1, far);
+      if (t0 > t1) return false;
+    }
+    t_enter = t0;
+    t_exit = t1;
+    return true;
+  }
+  bool Intersects(const Ray& ray, float t_max, float& t_enter) const {
+    float t_exit;
+    return Intersects(ray, t_max, t_enter, t_exit);
+  }
+};
+
+inline Aabb BoundsOf(const Vec3f& center, float radius) {
+  return Aabb{.min = center - radius, .max = center + radius};
+}
+
+inline Aabb BoundsOf(const Sphere& sphere) {
+  return BoundsOf(sphere.center, sphere.radius);
+}
+
+#endif // AABB_HPP_
@@ -0,0 +1,44 @@
+#ifndef ACCELERATOR_HPP_
+#define ACCELERATOR_HPP_
+
+#include "objects.hpp"
+#include "ray.hpp"
+#include "vec.hpp"
+#include <functional>
+#include <limits> // numeric_limits
+
+// nearest hit of a ray with the scene
+struct SceneHit {
+  bool is_hit{false};
+  ObjectId id{no_object};
+  Sphere obj{}; // world-space copy of the hit object
+  HitRecord hit{};
+};
+
+// decides whether a hit counts, e.g. whether it really blocks a light
+using HitFilter = std::function<bool(const Sphere& obj, const HitRecord& hit)>;
+
+// answers the ray queries of the tracer and the lights against all the
+// objects of a scene; implementations are free to skip objects a query
+// can't touch but must behave as if they tested all of them in id order
+class Accelerator {
+public:
+  virtual ~Accelerator() = default;
+
+  // nearest hit with 0 < t < t_max, ignoring object `skip`
+  virtual SceneHit Closest(const Ray& ray, ObjectId skip = no_object,
+                           float t_max = std::numeric_limits<float>::infinity())
+      const = 0;
+  // whether any hit with 0 < t < t_max, ignoring `skip`, passes `accept`
+  virtual bool AnyHit(const Ray& ray, ObjectId skip, float t_max,
+                      const HitFilter& accept) const = 0;
+  // call fn for every object that contains the point, in id order
+  virtual void ForEachContaining(
+      const Vec3f& point,
+      const std::function<void(ObjectId, const Sphere&)>& fn) const = 0;
+  // world-space copy of an object
+  virtual Sphere At(ObjectId id) const = 0;
+  virtual size_t size() const = 0;
+};
+
+#endif // ACCELERATOR_HPP_
@@ -0,0 +1,332 @@
+#ifndef GRID_ACCEL_HPP_
+#define GRID_ACCEL_HPP_
+
+#include "aabb.hpp"
+#include "accelerator.hpp"
+#include "mapping.hpp"
+#include "render_cost.hpp"
+#include "thread_pool.hpp"
+#include "timeline.hpp"
+#include "uniform_grid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <limits> // numeric_limits
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include <fcntl.h>    // open
+#include <unistd.h>   // close, pread
+
+// Built grids can be saved next to the scene and mapped back by later
+// runs instead of being rebuilt.
+//
+// File layout (native endianness):
+//   Header
+//   uint32_t offsets[ncells + 1]
+//   ObjectId refs[nrefs]
+namespace GridCache {
+
+constexpr char magic[8] = {'F', 'R', 'T', 'G', 'R', 'I', 'D', '\0'};
+constexpr uint32_t version = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  int32_t dims[3];
+  uint64_t scene_hash; // of the sphere geometry and the grid density
+  uint64_t nobjects;
+  uint64_t ncells;
+  uint64_t nrefs;
+};
+
+// FNV-1a over the bits of the centers and radii - materials don't
+// change the grid
+inline uint64_t HashGeometry(const std::vector<Sphere>& objects,
+                             float density) {
+  uint64_t hash = 0xcbf29ce484222325ull;
+  auto mix = [&hash](float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    hash = (hash ^ bits) * 0x100000001b3ull;
+  };
+  mix(density);
+  for (const auto& obj : objects) {
+    mix(obj.center.x);
+    mix(obj.center.y);
+    mix(obj.center.z);
+    mix(obj.radius);
+  }
+  return hash ^ objects.size();
+}
+
+} // namespace GridCache
+
+// what building a grid took, to compare it against other accelerators
+struct GridStats {
+  Vec3i32 dims{};
+  size_t cells{0};
+  size_t refs{0};      // object references over all cells
+  double build_s{0};   // wall time of the build or of loading the cache
+  bool from_cache{false};
+  bool cache_saved{false}; // false if the cache file couldn't be written
+  size_t bytes{0};     // spheres, cell offsets and references
+};
+
+// uniform grid over the scene bounds; every cell lists the objects whose
+// bounds overlap it and rays walk the cells they cross in order (3D-DDA,
+// Amanatides & Woo). Suits many objects of about the same size, e.g.
+// particles, where a hierarchy would mostly add overhead.
+class GridAccel : public Accelerator {
+public:
+  // density is the number of cells per object; the cell lists are filled
+  // in parallel on the pool
+  GridAccel(std::vector<Sphere> objects, ThreadPool& pool,
+            float density = 2.0f)
+      : GridAccel(std::move(objects), pool, std::string{}, density) {}
+
+  // same, but maps the cell lists from cache_path if it holds the grid of
+  // the same geometry and density; otherwise builds them and (re)writes
+  // the file for the next run - a failed write only costs that run the
+  // rebuild, see stats().cache_saved
+  GridAccel(std::vector<Sphere> objects, ThreadPool& pool,
+            const std::string& cache_path, float density = 2.0f)
+      : objects_(std::move(objects)) {
+    if (density <= 0)
+      throw std::invalid_argument("GridAccel: density must be positive");
+    TIMELINE_SCOPE("GridAccel build");
+    auto start = std::chrono::steady_clock::now();
+    Aabb bounds;
+    for (const auto& obj : objects_)
+      bounds.Expand(BoundsOf(obj));
+    grid_.Size(bounds, objects_.size(), density, max_cells);
+    uint64_t hash = 0;
+    if (!cache_path.empty()) {
+      hash = GridCache::HashGeometry(objects_, density);
+      stats_.from_cache = Load(cache_path, hash);
+    }
+    if (!stats_.from_cache) {
+      Fill(pool);
+      if (!cache_path.empty())
+        stats_.cache_saved = Save(cache_path, hash);
+    }
+    stats_.build_s = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start).count();
+    stats_.dims = Vec3i32{grid_.dims[0], grid_.dims[1], grid_.dims[2]};
+    stats_.cells = grid_.ncells;
+    stats_.refs = nrefs_;
+    stats_.bytes = objects_.size() * sizeof(Sphere) +
+                   (grid_.ncells + 1) * sizeof(uint32_t) +
+                   nrefs_ * sizeof(ObjectId);
+  }
+
+  SceneHit Closest(const Ray& ray, ObjectId skip,
+                   float t_max) const override {
+    SceneHit ret;
+    Walk(ray, t_max, [&](const ObjectId* first, const ObjectId* last,
+                         float t_cell_exit) {
+      for (const ObjectId* it = first; it != last; ++it) {
+        ObjectId id = *it;
+        if (id == skip) continue;
+        ++ray_cost.intersections;
+        auto hit = objects_[id].Intersects(ray);
+        if (!hit.is_hit || hit.t <= 0 || hit.t >= t_max) continue;
+        // objects spanning several cells come up more than once; equal
+        // distances go to the lower id as with a linear scan
+        if (ret.is_hit && (hit.t > ret.hit.t ||
+                           (hit.t == ret.hit.t && id >= ret.id)))
+          continue;
+        ret.is_hit = true;
+        ret.id = id;
+        ret.hit = hit;
+      }
+      // nothing in the cells further along can be nearer
+      return ret.is_hit && ret.hit.t <= t_cell_exit;
+    });
+    if (ret.is_hit)
+      ret.obj = objects_[ret.id];
+    return ret;
+  }
+
+  bool AnyHit(const Ray& ray, ObjectId skip, float t_max,
+              const HitFilter& accept) const override {
+    bool any = false;
+    Walk(ray, t_max, [&](const ObjectId* first, const ObjectId* last,
+                         float) {
+      for (const ObjectId* it = first; it != last; ++it) {
+        if (*it == skip) continue;
+        ++ray_cost.intersections;
+        auto hit = objects_[*it].Intersects(ray);
+        if (!hit.is_hit || hit.t <= 0 || hit.t >= t_max) continue;
+        if (accept(objects_[*it], hit)) {
+          any = true;
+          break;
+        }
+      }
+      return any;
+    });
+    return any;
+  }
+
+  void ForEachContaining(
+      const Vec3f& point,
+      const std::function<void(ObjectId, const Sphere&)>& fn) const override {
+    if (objects_.empty() || !grid_.bounds.Contains(point)) return;
+    size_t cell = grid_.IndexOf(point);
+    // cell lists are in id order
+    for (uint32_t i = offsets_[cell]; i < offsets_[cell + 1]; ++i) {
+      ObjectId id = refs_[i];
+      if (objects_[id].IsInside(point)) fn(id, objects_[id]);
+    }
+  }
+
+  Sphere At(ObjectId id) const override { return objects_.at(id); }
+  size_t size() const override { return objects_.size(); }
+  const GridStats& stats() const { return stats_; }
+
+private:
+  // upper bound on the cells so that sparse outliers can't blow up memory
+  static constexpr size_t max_cells = size_t{1} << 24;
+
+  // counting sort of (cell, object) pairs into per-cell lists
+  void Fill(ThreadPool& pool) {
+    const size_t ncells = grid_.ncells;
+    const int n = static_cast<int>(objects_.size());
+    built_offsets_.assign(ncells + 1, 0);
+    offsets_ = built_offsets_.data();
+    if (n == 0) return;
+    std::unique_ptr<std::atomic<uint32_t>[]> counts(
+        new std::atomic<uint32_t>[ncells]());
+    ParallelFor(pool, n, [&](int begin, int end) {
+      for (int id = begin; id < end; ++id)
+        grid_.ForEachCell(BoundsOf(objects_[id]), [&](size_t cell) {
+          counts[cell].fetch_add(1, std::memory_order_relaxed);
+        });
+    });
+    auto& offsets = built_offsets_;
+    for (size_t c = 0; c < ncells; ++c) {
+      offsets[c + 1] = offsets[c] + counts[c].load(std::memory_order_relaxed);
+      // reused as the fill cursor of each cell
+      counts[c].store(offsets[c], std::memory_order_relaxed);
+    }
+    auto& refs = built_refs_;
+    refs.resize(offsets[ncells]);
+    nrefs_ = refs.size();
+    refs_ = refs.data();
+    ParallelFor(pool, n, [&](int begin, int end) {
+      for (int id = begin; id < end; ++id)
+        grid_.ForEachCell(BoundsOf(objects_[id]), [&](size_t cell) {
+          refs[counts[cell].fetch_add(1, std::memory_order_relaxed)] = id;
+        });
+    });
+    // the threads filled the cells in any order
+    ParallelFor(pool, static_cast<int>(ncells), [&](int begin, int end) {
+      for (int c = begin; c < end; ++c)
+        std::sort(refs.begin() + offsets[c], refs.begin() + offsets[c + 1]);
+    });
+  }
+
+  // map the cell lists of a cache file; false if it is missing or was
+  // written for other geometry, density or by another version
+  bool Load(const std::string& path, uint64_t hash) {
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+      return false;
+    GridCache::Header header;
+    off_t size = lseek(fd, 0, SEEK_END);
+    bool valid =
+        pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+        std::memcmp(header.magic, GridCache::magic,
+                    sizeof(header.magic)) == 0 &&
+        header.version == GridCache::version &&
+        header.scene_hash == hash && header.nobjects == objects_.size() &&
+        header.dims[0] == grid_.dims[0] && header.dims[1] == grid_.dims[1] &&
+        header.dims[2] == grid_.dims[2] && header.ncells == grid_.ncells &&
+        static_cast<uint64_t>(size) ==
+            sizeof(header) + (header.ncells + 1) * sizeof(uint32_t) +
+                header.nrefs * sizeof(ObjectId);
+    if (valid) {
+      cache_ = std::make_unique<Mapping>(fd, 0, size);
+      offsets_ = reinterpret_cast<const uint32_t*>(cache_->data() +
+                                                   sizeof(header));
+      refs_ = reinterpret_cast<const ObjectId*>(offsets_ + grid_.ncells + 1);
+      nrefs_ = header.nrefs;
+      valid = ListsValid();
+      if (!valid) {
+        cache_.reset();
+        offsets_ = nullptr;
+        refs_ = nullptr;
+        nrefs_ = 0;
+      }
+    }
+    close(fd);
+    return valid;
+  }
+
+  // a corrupt cell list would send rays out of bounds: the offsets must
+  // rise from 0 to nrefs_ and every reference name an object
+  bool ListsValid() const {
+    if (offsets_[0] != 0 || offsets_[grid_.ncells] != nrefs_) return false;
+    for (size_t c = 0; c < grid_.ncells; ++c)
+      if (offsets_[c] > offsets_[c + 1]) return false;
+    for (size_t i = 0; i < nrefs_; ++i)
+      if (refs_[i] >= objects_.size()) return false;
+    return true;
+  }
+
+  // write through a temporary file so that readers never see a partial
+  // one; false if the file couldn't be written, e.g. a read-only or full
+  // directory
+  bool Save(const std::string& path, uint64_t hash) const {
+    GridCache::Header header{};
+    std::memcpy(header.magic, GridCache::magic, sizeof(header.magic));
+    header.version = GridCache::version;
+    std::copy(grid_.dims, grid_.dims + 3, header.dims);
+    header.scene_hash = hash;
+    header.nobjects = objects_.size();
+    header.ncells = grid_.ncells;
+    header.nrefs = nrefs_;
+    std::string tmp = path + ".tmp";
+    FILE* out = std::fopen(tmp.c_str(), "wb");
+    if (!out)
+      return false;
+    bool ok = std::fwrite(&header, sizeof(header), 1, out) == 1 &&
+              std::fwrite(offsets_, sizeof(uint32_t), grid_.ncells + 1, out) ==
+                  grid_.ncells + 1 &&
+              std::fwrite(refs_, sizeof(ObjectId), nrefs_, out) == nrefs_;
+    ok = std::fclose(out) == 0 && ok;
+    if (!ok || std::rename(tmp.c_str(), path.c_str()) != 0) {
+      std::remove(tmp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+  // call visit(first, last, t_cell_exit) with the object list of every
+  // cell the ray crosses within [0, t_max], nearest first, until it
+  // returns true
+  template <typename F>
+  void Walk(const Ray& ray, float t_max, F&& visit) const {
+    grid_.Walk(ray, t_max, [&](size_t c, float t_cell_exit) {
+      return visit(refs_ + offsets_[c], refs_ + offsets_[c + 1], t_cell_exit);
+    });
+  }
+
+  std::vector<Sphere> objects_;
+  UniformGrid grid_;
+  size_t nrefs_{0};
+  // cell c lists refs_[offsets_[c], offsets_[c + 1]); both point to the
+  // built lists or into the mapped cache file
+  const uint32_t* offsets_{nullptr};
+  const ObjectId* refs_{nullptr};
+  std::vector<uint32_t> built_offsets_;
+  std::vector<ObjectId> built_refs_;
+  std::unique_ptr<Mapping> cache_;
+  GridStats stats_{};
+};
+
+#endif // GRID_ACCEL_HPP_
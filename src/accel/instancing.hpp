@@ -0,0 +1,256 @@
+#ifndef INSTANCING_HPP_
+#define INSTANCING_HPP_
+
+#include "aabb.hpp"
+#include "accelerator.hpp"
+#include "linear_accel.hpp"
+#include "mat3x3.hpp"
+#include "uniform_grid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <vector>
+
+// group of spheres (in its own local coordinates) defined once and
+// placed in the scene many times by an InstancedScene
+class Prototype {
+public:
+  // spheres added one by one and tested linearly - for a handful of them
+  Prototype() : accel_(std::make_shared<LinearAccel>(spheres_)) {}
+  // the spheres of an accelerator built over them, e.g. a GridAccel for
+  // prototypes with many spheres
+  explicit Prototype(std::shared_ptr<const Accelerator> accel)
+      : accel_(std::move(accel)), from_accel_(true) {
+    if (!accel_)
+      throw std::invalid_argument("Prototype: accelerator is null");
+    for (ObjectId id = 0; id < accel_->size(); ++id)
+      bounds_.Expand(BoundsOf(accel_->At(id)));
+  }
+  // the linear accelerator refers to the spheres - keep them in place
+  Prototype(const Prototype&) = delete;
+  Prototype& operator=(const Prototype&) = delete;
+
+  void Add(const Sphere& sphere) {
+    if (from_accel_)
+      throw std::runtime_error(
+          "ERROR: Can't add spheres to a prototype built from an accelerator");
+    spheres_.push_back(sphere);
+    bounds_.Expand(BoundsOf(sphere));
+  }
+  const Accelerator& accel() const { return *accel_; }
+  const Aabb& bounds() const { return bounds_; }
+  size_t size() const { return accel_->size(); }
+
+private:
+  std::vector<Sphere> spheres_;
+  std::shared_ptr<const Accelerator> accel_;
+  bool from_accel_{false};
+  Aabb bounds_{};
+};
+
+// scene made of placed copies of prototypes - memory grows with the
+// unique geometry, not with the number of copies. Rays are moved into
+// the local space of an instance rather than the instance into the world.
+// A uniform grid over the instance bounds, built by the first query after
+// instances were added, gives rays the instances along them in order.
+class InstancedScene : public Accelerator {
+public:
+  // place a prototype as p_world = rot * p_local + translation; rot must
+  // be a rotation (orthonormal) so that distances along rays are kept.
+  // Not while the scene is being rendered.
+  void AddInstance(std::shared_ptr<const Prototype> prototype,
+                   const Mat3x3& rot = {}, const Vec3f& translation = {},
+                   std::optional<Material> material = std::nullopt) {
+    Instance inst;
+    inst.rot = rot;
+    inst.rot_inv = rot.Transpose();
+    inst.translation = translation;
+    inst.material = std::move(material);
+    inst.first = size_;
+    // world bounds of the transformed local bounds' corners
+    const Aabb& local = prototype->bounds();
+    for (int corner = 0; corner < 8; ++corner) {
+      Vec3f p{(corner & 1) ? local.max.x : local.min.x,
+              (corner & 2) ? local.max.y : local.min.y,
+              (corner & 4) ? local.max.z : local.min.z};
+      inst.bounds.Expand(rot * p + translation);
+    }
+    size_ += prototype->size();
+    inst.prototype = std::move(prototype);
+    instances_.push_back(std::move(inst));
+    indexed_.store(false, std::memory_order_release);
+  }
+
+  SceneHit Closest(const Ray& ray, ObjectId skip,
+                   float t_max) const override {
+    SceneHit ret;
+    float t_nearest = t_max;
+    VisitMarks visited(instances_.size());
+    Walk(ray, t_max, [&](const uint32_t* first, const uint32_t* last,
+                         float t_cell_exit) {
+      for (const uint32_t* it = first; it != last; ++it) {
+        // instances overlapping several cells come up more than once
+        const auto& inst = instances_[*it];
+        float t_enter;
+        if (!visited.Visit(*it) ||
+            !inst.bounds.Intersects(ray, t_nearest, t_enter))
+          continue;
+        auto hit = inst.prototype->accel().Closest(
+            ToLocal(inst, ray), LocalId(inst, skip), t_nearest);
+        if (!hit.is_hit) continue;
+        t_nearest = hit.hit.t;
+        ret.is_hit = true;
+        ret.id = inst.first + hit.id;
+        ret.hit = ToWorld(inst, hit.hit);
+        ret.obj = ToWorld(inst, hit.obj);
+      }
+      // nothing in the cells further along can be nearer
+      return ret.is_hit && t_nearest <= t_cell_exit;
+    });
+    return ret;
+  }
+
+  bool AnyHit(const Ray& ray, ObjectId skip, float t_max,
+              const HitFilter& accept) const override {
+    bool any = false;
+    VisitMarks visited(instances_.size());
+    Walk(ray, t_max, [&](const uint32_t* first, const uint32_t* last,
+                         float) {
+      for (const uint32_t* it = first; it != last && !any; ++it) {
+        const auto& inst = instances_[*it];
+        float t_enter;
+        if (!visited.Visit(*it) ||
+            !inst.bounds.Intersects(ray, t_max, t_enter))
+          continue;
+        any = inst.prototype->accel().AnyHit(
+            ToLocal(inst, ray), LocalId(inst, skip), t_max,
+            [&](const Sphere& obj, const HitRecord& hit) {
+              return accept(ToWorld(inst, obj), ToWorld(inst, hit));
+            });
+      }
+      return any;
+    });
+    return any;
+  }
+
+  void ForEachContaining(
+      const Vec3f& point,
+      const std::function<void(ObjectId, const Sphere&)>& fn) const override {
+    Index();
+    if (instances_.empty() || !grid_.bounds.Contains(point)) return;
+    // cell lists are in instance order and instances in id order
+    size_t cell = grid_.IndexOf(point);
+    for (uint32_t i = cell_offsets_[cell]; i < cell_offsets_[cell + 1]; ++i) {
+      const auto& inst = instances_[cell_instances_[i]];
+      if (!inst.bounds.Contains(point)) continue;
+      Vec3f local = inst.rot_inv * (point - inst.translation);
+      inst.prototype->accel().ForEachContaining(
+          local, [&](ObjectId id, const Sphere& obj) {
+            fn(inst.first + id, ToWorld(inst, obj));
+          });
+    }
+  }
+
+  Sphere At(ObjectId id) const override {
+    if (id >= size_)
+      throw std::out_of_range("InstancedScene::At: id out of range");
+    // last instance starting at or before id
+    auto it = std::upper_bound(instances_.begin(), instances_.end(), id,
+                               [](ObjectId id, const Instance& inst) {
+                                 return id < inst.first;
+                               });
+    const auto& inst = *std::prev(it);
+    return ToWorld(inst, inst.prototype->accel().At(id - inst.first));
+  }
+
+  size_t size() const override { return size_; }
+  size_t ninstances() const { return instances_.size(); }
+
+private:
+  struct Instance {
+    std::shared_ptr<const Prototype> prototype;
+    Mat3x3 rot{};
+    Mat3x3 rot_inv{};
+    Vec3f translation{};
+    std::optional<Material> material{};
+    Aabb bounds{};         // world space
+    ObjectId first{0};     // id of the first sphere of the instance
+  };
+
+  static Ray ToLocal(const Instance& inst, const Ray& ray) {
+    Ray ret({}, {});
+    ret.origin = inst.rot_inv * (ray.origin - inst.translation);
+    ret.dir = inst.rot_inv * ray.dir;
+    return ret;
+  }
+  static HitRecord ToWorld(const Instance& inst, HitRecord hit) {
+    hit.where = inst.rot * hit.where + inst.translation;
+    return hit;
+  }
+  static Sphere ToWorld(const Instance& inst, Sphere obj) {
+    obj.center = inst.rot * obj.center + inst.translation;
+    if (inst.material)
+      obj.material = *inst.material;
+    return obj;
+  }
+  // (re)build the grid if instances were added since the last query
+  void Index() const {
+    if (indexed_.load(std::memory_order_acquire)) return;
+    std::lock_guard<std::mutex> lock(index_mutex_);
+    if (indexed_.load(std::memory_order_relaxed)) return;
+    Aabb bounds;
+    for (const auto& inst : instances_)
+      bounds.Expand(inst.bounds);
+    grid_.Size(bounds, instances_.size(), 2.0f, size_t{1} << 20);
+    cell_offsets_.assign(grid_.ncells + 1, 0);
+    for (const auto& inst : instances_)
+      grid_.ForEachCell(inst.bounds,
+                        [&](size_t cell) { ++cell_offsets_[cell + 1]; });
+    for (size_t c = 0; c < grid_.ncells; ++c)
+      cell_offsets_[c + 1] += cell_offsets_[c];
+    cell_instances_.resize(cell_offsets_.back());
+    std::vector<uint32_t> cursor(cell_offsets_.begin(),
+                                 cell_offsets_.end() - 1);
+    for (uint32_t i = 0; i < instances_.size(); ++i)
+      grid_.ForEachCell(instances_[i].bounds, [&](size_t cell) {
+        cell_instances_[cursor[cell]++] = i;
+      });
+    indexed_.store(true, std::memory_order_release);
+  }
+
+  // call visit(first, last, t_cell_exit) with the instance list of every
+  // cell the ray crosses within [0, t_max], nearest first, until it
+  // returns true
+  template <typename F>
+  void Walk(const Ray& ray, float t_max, F&& visit) const {
+    Index();
+    const uint32_t* list = cell_instances_.data();
+    grid_.Walk(ray, t_max, [&](size_t c, float t_cell_exit) {
+      return visit(list + cell_offsets_[c], list + cell_offsets_[c + 1],
+                   t_cell_exit);
+    });
+  }
+
+  // id of `skip` within the instance, if it belongs to it
+  static ObjectId LocalId(const Instance& inst, ObjectId skip) {
+    if (skip == no_object || skip < inst.first ||
+        skip - inst.first >= inst.prototype->size())
+      return no_object;
+    return skip - inst.first;
+  }
+
+  std::vector<Instance> instances_;
+  size_t size_{0};
+  // instances whose bounds overlap cell c: cell_instances_[cell_offsets_[c],
+  // cell_offsets_[c + 1])
+  mutable UniformGrid grid_;
+  mutable std::vector<uint32_t> cell_offsets_;
+  mutable std::vector<uint32_t> cell_instances_;
+  mutable std::atomic<bool> indexed_{false};
+  mutable std::mutex index_mutex_;
+};
+
+#endif // INSTANCING_HPP_
@@ -0,0 +1,60 @@
+#ifndef LINEAR_ACCEL_HPP_
+#define LINEAR_ACCEL_HPP_
+
+#include "accelerator.hpp"
+#include "render_cost.hpp"
+#include <vector>
+
+// no acceleration - tests every object; fine for a handful of them
+class LinearAccel : public Accelerator {
+public:
+  explicit LinearAccel(const std::vector<Sphere>& objects)
+      : objects_(objects) {}
+
+  SceneHit Closest(const Ray& ray, ObjectId skip,
+                   float t_max) const override {
+    SceneHit ret;
+    float t_nearest = t_max;
+    for (ObjectId id = 0; id < objects_.size(); ++id) {
+      if (id == skip) continue;
+      ++ray_cost.intersections;
+      auto hit = objects_[id].Intersects(ray);
+      // reject hits that are behind the ray's origin or too far
+      if (!hit.is_hit || hit.t <= 0 || hit.t >= t_nearest) continue;
+      t_nearest = hit.t;
+      ret.is_hit = true;
+      ret.id = id;
+      ret.hit = hit;
+    }
+    if (ret.is_hit)
+      ret.obj = objects_[ret.id];
+    return ret;
+  }
+
+  bool AnyHit(const Ray& ray, ObjectId skip, float t_max,
+              const HitFilter& accept) const override {
+    for (ObjectId id = 0; id < objects_.size(); ++id) {
+      if (id == skip) continue;
+      ++ray_cost.intersections;
+      auto hit = objects_[id].Intersects(ray);
+      if (!hit.is_hit || hit.t <= 0 || hit.t >= t_max) continue;
+      if (accept(objects_[id], hit)) return true;
+    }
+    return false;
+  }
+
+  void ForEachContaining(
+      const Vec3f& point,
+      const std::function<void(ObjectId, const Sphere&)>& fn) const override {
+    for (ObjectId id = 0; id < objects_.size(); ++id)
+      if (objects_[id].IsInside(point)) fn(id, objects_[id]);
+  }
+
+  Sphere At(ObjectId id) const override { return objects_.at(id); }
+  size_t size() const override { return objects_.size(); }
+
+private:
+  const std::vector<Sphere>& objects_;
+};
+
+#endif // LINEAR_ACCEL_HPP_
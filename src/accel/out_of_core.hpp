@@ -0,0 +1,548 @@
+#ifndef OUT_OF_CORE_HPP_
+#define OUT_OF_CORE_HPP_
+
+#include "aabb.hpp"
+#include "accelerator.hpp"
+#include "mapping.hpp"
+#include "render_cost.hpp"
+#include "uniform_grid.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <fcntl.h>    // open
+#include <unistd.h>   // close
+
+// Scenes too large for memory as std::vector<Sphere> (each with a vtable
+// pointer and its own Material) are written to disk as compact records,
+// grouped into spatial chunks. Rendering maps the chunks a ray may touch
+// on demand and unmaps the least recently used ones to stay within a
+// memory budget.
+//
+// File layout (native endianness):
+//   Header
+//   PackedMaterial[nmaterials]
+//   Chunk[nchunks]
+//   PackedSphere[nspheres] - grouped by chunk
+namespace Ooc {
+
+constexpr char magic[8] = {'F', 'R', 'T', 'O', 'O', 'C', '\0', '\0'};
+constexpr uint32_t version = 1;
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t nmaterials;
+  uint32_t nchunks;
+  uint32_t nspheres;
+};
+
+struct PackedMaterial {
+  uint8_t color[3];
+  float specular;
+  float reflective;
+  float transparency;
+  float refractive_index;
+  float tint;
+};
+
+// a sphere in 20 bytes - the material is an index to the material table
+struct PackedSphere {
+  float center[3];
+  float radius;
+  uint32_t material;
+};
+
+struct Chunk {
+  Aabb bounds;     // of all its spheres
+  uint64_t offset; // of its first record from the start of the file
+  ObjectId first;  // id of its first sphere
+  uint32_t count;
+};
+
+inline PackedMaterial Pack(const Material& m) {
+  return PackedMaterial{.color = {m.color.x, m.color.y, m.color.z},
+                        .specular = m.specular,
+                        .reflective = m.reflective,
+                        .transparency = m.transparency,
+                        .refractive_index = m.refractive_index,
+                        .tint = m.tint};
+}
+
+inline Material Unpack(const PackedMaterial& p) {
+  Material ret;
+  ret.color = Vec3u8{p.color[0], p.color[1], p.color[2]};
+  ret.specular = p.specular;
+  ret.reflective = p.reflective;
+  ret.transparency = p.transparency;
+  ret.refractive_index = p.refractive_index;
+  ret.tint = p.tint;
+  return ret;
+}
+
+} // namespace Ooc
+
+// streams spheres to disk and groups them into spatial chunks; memory
+// use is bounded independently of the number of spheres. The scene numbers the
+// spheres chunk by chunk, not in the order they were added.
+class OutOfCoreWriter {
+public:
+  // the scene bounds are split into grid^3 cells, one chunk per
+  // non-empty cell
+  explicit OutOfCoreWriter(std::string path, int grid = 16)
+      : path_(std::move(path)), grid_(std::max(1, grid)) {
+    tmp_ = std::fopen((path_ + ".tmp").c_str(), "wb");
+    if (!tmp_)
+      throw std::runtime_error("ERROR: Could not write to file " + path_ +
+                               ".tmp");
+  }
+  ~OutOfCoreWriter() {
+    if (tmp_) {
+      std::fclose(tmp_);
+      std::remove((path_ + ".tmp").c_str());
+    }
+  }
+
+  void Add(const Sphere& sphere) {
+    Ooc::PackedSphere rec{.center = {sphere.center.x, sphere.center.y,
+                                     sphere.center.z},
+                          .radius = sphere.radius,
+                          .material = MaterialIndex(sphere.material)};
+    if (std::fwrite(&rec, sizeof(rec), 1, tmp_) != 1)
+      throw std::runtime_error("ERROR: Could not write to file " + path_ +
+                               ".tmp");
+    centers_.Expand(sphere.center);
+    ++nspheres_;
+  }
+
+  // sort the spheres into chunks and write the final file
+  void Finish() {
+    std::fclose(tmp_);
+    tmp_ = nullptr;
+    const std::string tmp_path = path_ + ".tmp";
+    int fd_in = open(tmp_path.c_str(), O_RDONLY);
+    if (fd_in < 0)
+      throw std::runtime_error("ERROR: Could not read file " + tmp_path);
+    const size_t bytes = nspheres_ * sizeof(Ooc::PackedSphere);
+    std::unique_ptr<Mapping> in;
+    const Ooc::PackedSphere* recs = nullptr;
+    if (bytes > 0) {
+      in = std::make_unique<Mapping>(fd_in, 0, bytes);
+      recs = reinterpret_cast<const Ooc::PackedSphere*>(in->data());
+    }
+
+    // 1st pass - count the spheres and find the bounds of each cell
+    const size_t ncells = static_cast<size_t>(grid_) * grid_ * grid_;
+    std::vector<uint32_t> counts(ncells, 0);
+    std::vector<Aabb> bounds(ncells);
+    for (size_t i = 0; i < nspheres_; ++i) {
+      size_t cell = CellOf(recs[i]);
+      ++counts[cell];
+      bounds[cell].Expand(BoundsOf(CenterOf(recs[i]), recs[i].radius));
+    }
+    std::vector<Ooc::Chunk> chunks;
+    std::vector<uint32_t> chunk_of_cell(ncells, 0);
+    const uint64_t records_start =
+        sizeof(Ooc::Header) +
+        materials_.size() * sizeof(Ooc::PackedMaterial);
+    ObjectId first = 0;
+    for (size_t cell = 0; cell < ncells; ++cell) {
+      if (counts[cell] == 0) continue;
+      chunk_of_cell[cell] = chunks.size();
+      chunks.push_back(Ooc::Chunk{.bounds = bounds[cell],
+                                  .offset = 0,
+                                  .first = first,
+                                  .count = counts[cell]});
+      first += counts[cell];
+    }
+    const uint64_t data_start =
+        records_start + chunks.size() * sizeof(Ooc::Chunk);
+    for (auto& chunk : chunks)
+      chunk.offset = data_start + chunk.first * sizeof(Ooc::PackedSphere);
+
+    // 2nd pass - scatter the records to their chunk in the output file
+    // through a window of the record region, written in one call once
+    // filled; records are placed in the same order on every pass over
+    // the input, so a scene larger than the window takes a pass per window
+    FILE* out = std::fopen(path_.c_str(), "wb");
+    if (!out)
+      throw std::runtime_error("ERROR: Could not write to file " + path_);
+    Ooc::Header header{.magic = {},
+                       .version = Ooc::version,
+                       .nmaterials = static_cast<uint32_t>(materials_.size()),
+                       .nchunks = static_cast<uint32_t>(chunks.size()),
+                       .nspheres = static_cast<uint32_t>(nspheres_)};
+    std::memcpy(header.magic, Ooc::magic, sizeof(header.magic));
+    std::fwrite(&header, sizeof(header), 1, out);
+    std::fwrite(materials_.data(), sizeof(Ooc::PackedMaterial),
+                materials_.size(), out);
+    std::fwrite(chunks.data(), sizeof(Ooc::Chunk), chunks.size(), out);
+    std::vector<Ooc::PackedSphere> window(std::min(nspheres_, window_records));
+    std::vector<size_t> cursor(chunks.size());
+    bool ok = true;
+    for (size_t lo = 0; lo < nspheres_ && ok; lo += window.size()) {
+      const size_t hi = std::min(nspheres_, lo + window.size());
+      for (size_t c = 0; c < chunks.size(); ++c)
+        cursor[c] = chunks[c].first;
+      for (size_t i = 0; i < nspheres_; ++i) {
+        size_t at = cursor[chunk_of_cell[CellOf(recs[i])]]++;
+        if (at >= lo && at < hi) window[at - lo] = recs[i];
+      }
+      ok = std::fwrite(window.data(), sizeof(Ooc::PackedSphere), hi - lo,
+                       out) == hi - lo;
+    }
+    ok &= std::ferror(out) == 0;
+    ok &= std::fclose(out) == 0;
+    in.reset();
+    close(fd_in);
+    std::remove(tmp_path.c_str());
+    if (!ok)
+      throw std::runtime_error("ERROR: Could not write to file " + path_);
+  }
+
+private:
+  // records sorted into chunks in memory at a time
+  static constexpr size_t window_records =
+      (size_t{64} << 20) / sizeof(Ooc::PackedSphere);
+
+  uint32_t MaterialIndex(const Material& m) {
+    auto key = std::make_tuple(m.color.x, m.color.y, m.color.z, m.specular,
+                               m.reflective, m.transparency,
+                               m.refractive_index, m.tint);
+    auto it = material_ids_.find(key);
+    if (it != material_ids_.end())
+      return it->second;
+    uint32_t ret = materials_.size();
+    materials_.push_back(Ooc::Pack(m));
+    material_ids_.emplace(key, ret);
+    return ret;
+  }
+
+  static Vec3f CenterOf(const Ooc::PackedSphere& rec) {
+    return Vec3f{rec.center[0], rec.center[1], rec.center[2]};
+  }
+
+  size_t CellOf(const Ooc::PackedSphere& rec) const {
+    size_t ret = 0;
+    for (int i = 0; i < 3; ++i) {
+      float extent = centers_.max.xyz[i] - centers_.min.xyz[i];
+      float u = extent > 0 ? (rec.center[i] - centers_.min.xyz[i]) / extent
+                           : 0.0f;
+      int cell = std::clamp(static_cast<int>(u * grid_), 0, grid_ - 1);
+      ret = ret * grid_ + cell;
+    }
+    return ret;
+  }
+
+  std::string path_;
+  int grid_;
+  FILE* tmp_{nullptr};
+  size_t nspheres_{0};
+  Aabb centers_{};
+  std::vector<Ooc::PackedMaterial> materials_;
+  std::map<std::tuple<uint8_t, uint8_t, uint8_t, float, float, float, float,
+                      float>,
+           uint32_t>
+      material_ids_;
+};
+
+// paging statistics of an OutOfCoreScene
+struct OutOfCoreStats {
+  uint64_t page_ins{0};  // chunks mapped
+  uint64_t evictions{0}; // chunks unmapped to stay within budget
+  uint64_t hits{0};      // chunk accesses that were already resident
+  uint64_t bytes_paged_in{0};
+  size_t resident_bytes{0};
+  size_t peak_resident_bytes{0};
+};
+
+// renders a file written by OutOfCoreWriter
+class OutOfCoreScene : public Accelerator {
+public:
+  // memory_budget: bytes of sphere records kept mapped at a time; a
+  // query keeps the chunks it reads alive, so the budget can briefly be
+  // exceeded by what the rendering threads are reading right then
+  OutOfCoreScene(const std::string& path, size_t memory_budget)
+      : budget_(memory_budget) {
+    fd_ = open(path.c_str(), O_RDONLY);
+    if (fd_ < 0)
+      throw std::runtime_error("ERROR: Could not read file " + path);
+    Ooc::Header header;
+    bool ok = pread(fd_, &header, sizeof(header), 0) == sizeof(header) &&
+              std::memcmp(header.magic, Ooc::magic, sizeof(Ooc::magic)) == 0 &&
+              header.version == Ooc::version;
+    if (ok) {
+      std::vector<Ooc::PackedMaterial> packed(header.nmaterials);
+      chunks_.resize(header.nchunks);
+      size_t mat_bytes = packed.size() * sizeof(Ooc::PackedMaterial);
+      size_t chunk_bytes = chunks_.size() * sizeof(Ooc::Chunk);
+      ok = pread(fd_, packed.data(), mat_bytes, sizeof(header)) ==
+               static_cast<ssize_t>(mat_bytes) &&
+           pread(fd_, chunks_.data(), chunk_bytes,
+                 sizeof(header) + mat_bytes) ==
+               static_cast<ssize_t>(chunk_bytes);
+      for (const auto& p : packed)
+        materials_.push_back(Ooc::Unpack(p));
+      nspheres_ = header.nspheres;
+    }
+    if (!ok) {
+      close(fd_);
+      throw std::runtime_error("ERROR: Not an out-of-core scene file " + path);
+    }
+    resident_.resize(chunks_.size());
+    referenced_ = std::make_unique<std::atomic<bool>[]>(chunks_.size());
+    lru_pos_.resize(chunks_.size(), lru_.end());
+    IndexChunks();
+  }
+  ~OutOfCoreScene() override {
+    resident_.clear();
+    close(fd_);
+  }
+  OutOfCoreScene(const OutOfCoreScene&) = delete;
+  OutOfCoreScene& operator=(const OutOfCoreScene&) = delete;
+
+  SceneHit Closest(const Ray& ray, ObjectId skip,
+                   float t_max) const override {
+    SceneHit ret;
+    float t_nearest = t_max;
+    VisitMarks visited(chunks_.size());
+    WalkChunks(ray, t_max, [&](const uint32_t* first, const uint32_t* last,
+                               float t_cell_exit) {
+      for (const uint32_t* it = first; it != last; ++it) {
+        // chunks overlapping several cells come up more than once, and
+        // the ones the ray only crosses behind the nearest hit are skipped
+        uint32_t c = *it;
+        float t_enter;
+        if (!visited.Visit(c) ||
+            !chunks_[c].bounds.Intersects(ray, t_nearest, t_enter))
+          continue;
+        auto chunk = PageIn(c);
+        const auto* recs = Records(*chunk);
+        for (uint32_t i = 0; i < chunks_[c].count; ++i) {
+          ObjectId id = chunks_[c].first + i;
+          if (id == skip) continue;
+          ++ray_cost.intersections;
+          auto hit = IntersectSphere(Center(recs[i]), recs[i].radius, ray);
+          if (!hit.is_hit || hit.t <= 0 || hit.t >= t_max) continue;
+          // equal distances go to the lower id as with a linear scan
+          if (ret.is_hit && (hit.t > t_nearest ||
+                             (hit.t == t_nearest && id >= ret.id)))
+            continue;
+          t_nearest = hit.t;
+          ret.is_hit = true;
+          ret.id = id;
+          ret.hit = hit;
+          ret.obj = ToSphere(recs[i]);
+        }
+      }
+      // nothing in the cells further along can be nearer
+      return ret.is_hit && t_nearest <= t_cell_exit;
+    });
+    return ret;
+  }
+
+  bool AnyHit(const Ray& ray, ObjectId skip, float t_max,
+              const HitFilter& accept) const override {
+    bool any = false;
+    VisitMarks visited(chunks_.size());
+    WalkChunks(ray, t_max, [&](const uint32_t* first, const uint32_t* last,
+                               float) {
+      for (const uint32_t* it = first; it != last && !any; ++it) {
+        uint32_t c = *it;
+        float t_enter;
+        if (!visited.Visit(c) ||
+            !chunks_[c].bounds.Intersects(ray, t_max, t_enter))
+          continue;
+        auto chunk = PageIn(c);
+        const auto* recs = Records(*chunk);
+        for (uint32_t i = 0; i < chunks_[c].count; ++i) {
+          if (chunks_[c].first + i == skip) continue;
+          ++ray_cost.intersections;
+          auto hit = IntersectSphere(Center(recs[i]), recs[i].radius, ray);
+          if (!hit.is_hit || hit.t <= 0 || hit.t >= t_max) continue;
+          if (accept(ToSphere(recs[i]), hit)) {
+            any = true;
+            break;
+          }
+        }
+      }
+      return any;
+    });
+    return any;
+  }
+
+  void ForEachContaining(
+      const Vec3f& point,
+      const std::function<void(ObjectId, const Sphere&)>& fn) const override {
+    if (chunks_.empty() || !grid_.bounds.Contains(point)) return;
+    // cell lists are in chunk order and chunks in id order
+    size_t cell = grid_.IndexOf(point);
+    for (uint32_t i = cell_offsets_[cell]; i < cell_offsets_[cell + 1]; ++i) {
+      uint32_t c = cell_chunks_[i];
+      if (!chunks_[c].bounds.Contains(point)) continue;
+      auto chunk = PageIn(c);
+      const auto* recs = Records(*chunk);
+      for (uint32_t i = 0; i < chunks_[c].count; ++i) {
+        Vec3f d = point - Center(recs[i]);
+        if (d.Dot(d) < recs[i].radius * recs[i].radius)
+          fn(chunks_[c].first + i, ToSphere(recs[i]));
+      }
+    }
+  }
+
+  Sphere At(ObjectId id) const override {
+    if (id >= nspheres_)
+      throw std::out_of_range("OutOfCoreScene::At: id out of range");
+    // last chunk starting at or before id
+    auto it = std::upper_bound(chunks_.begin(), chunks_.end(), id,
+                               [](ObjectId id, const Ooc::Chunk& chunk) {
+                                 return id < chunk.first;
+                               });
+    uint32_t c = std::prev(it) - chunks_.begin();
+    auto chunk = PageIn(c);
+    return ToSphere(Records(*chunk)[id - chunks_[c].first]);
+  }
+
+  size_t size() const override { return nspheres_; }
+  size_t nchunks() const { return chunks_.size(); }
+
+  OutOfCoreStats stats() const {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    OutOfCoreStats ret = stats_;
+    ret.hits = hits_.load(std::memory_order_relaxed);
+    return ret;
+  }
+
+private:
+  using Resident = Mapping;
+
+  static Vec3f Center(const Ooc::PackedSphere& rec) {
+    return Vec3f{rec.center[0], rec.center[1], rec.center[2]};
+  }
+  static const Ooc::PackedSphere* Records(const Resident& chunk) {
+    return reinterpret_cast<const Ooc::PackedSphere*>(chunk.data());
+  }
+  Sphere ToSphere(const Ooc::PackedSphere& rec) const {
+    Sphere ret;
+    ret.center = Center(rec);
+    ret.radius = rec.radius;
+    ret.material = materials_[rec.material];
+    return ret;
+  }
+
+  // uniform grid over the chunk bounds - they overlap where spheres
+  // stick out of the writer's cells, so a cell lists every chunk whose
+  // bounds overlap it
+  void IndexChunks() {
+    Aabb bounds;
+    for (const auto& chunk : chunks_)
+      bounds.Expand(chunk.bounds);
+    grid_.Size(bounds, chunks_.size(), 1.0f, size_t{1} << 20);
+    cell_offsets_.assign(grid_.ncells + 1, 0);
+    for (const auto& chunk : chunks_)
+      grid_.ForEachCell(chunk.bounds,
+                        [&](size_t cell) { ++cell_offsets_[cell + 1]; });
+    for (size_t c = 0; c < grid_.ncells; ++c)
+      cell_offsets_[c + 1] += cell_offsets_[c];
+    cell_chunks_.resize(cell_offsets_.back());
+    std::vector<uint32_t> cursor(cell_offsets_.begin(),
+                                 cell_offsets_.end() - 1);
+    for (uint32_t c = 0; c < chunks_.size(); ++c)
+      grid_.ForEachCell(chunks_[c].bounds, [&](size_t cell) {
+        cell_chunks_[cursor[cell]++] = c;
+      });
+  }
+
+  // call visit(first, last, t_cell_exit) with the chunk list of every
+  // cell the ray crosses within [0, t_max], nearest first, until it
+  // returns true
+  template <typename F>
+  void WalkChunks(const Ray& ray, float t_max, F&& visit) const {
+    const uint32_t* chunks = cell_chunks_.data();
+    grid_.Walk(ray, t_max, [&](size_t c, float t_cell_exit) {
+      return visit(chunks + cell_offsets_[c], chunks + cell_offsets_[c + 1],
+                   t_cell_exit);
+    });
+  }
+
+  // map a chunk if it isn't already and unmap the least recently used
+  // ones past the budget; the returned pointer keeps the chunk mapped.
+  // Resident chunks are only looked up under a shared lock and marked as
+  // used, so the render threads don't serialize on them; eviction gives
+  // the marked ones a second chance instead of keeping an exact LRU order
+  std::shared_ptr<const Resident> PageIn(uint32_t c) const {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex_);
+      if (resident_[c]) return Hit(c);
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex_);
+    // another thread may have mapped it meanwhile
+    if (resident_[c]) return Hit(c);
+    auto chunk = std::make_shared<const Resident>(
+        fd_, chunks_[c].offset, chunks_[c].count * sizeof(Ooc::PackedSphere));
+    resident_[c] = chunk;
+    lru_.push_front(c);
+    lru_pos_[c] = lru_.begin();
+    ++stats_.page_ins;
+    stats_.bytes_paged_in += chunk->length();
+    stats_.resident_bytes += chunk->length();
+    // never evict the chunk just mapped; the marks can't change meanwhile
+    // as lookups wait for the exclusive lock
+    while (stats_.resident_bytes > budget_ && lru_.size() > 1) {
+      uint32_t victim = lru_.back();
+      if (victim == c ||
+          referenced_[victim].exchange(false, std::memory_order_relaxed)) {
+        lru_.splice(lru_.begin(), lru_, lru_pos_[victim]);
+        continue;
+      }
+      lru_.pop_back();
+      lru_pos_[victim] = lru_.end();
+      stats_.resident_bytes -= resident_[victim]->length();
+      resident_[victim].reset();
+      ++stats_.evictions;
+    }
+    stats_.peak_resident_bytes =
+        std::max(stats_.peak_resident_bytes, stats_.resident_bytes);
+    return chunk;
+  }
+  // a resident chunk, with the lock held shared or exclusive
+  std::shared_ptr<const Resident> Hit(uint32_t c) const {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    referenced_[c].store(true, std::memory_order_relaxed);
+    return resident_[c];
+  }
+
+  int fd_{-1};
+  size_t budget_;
+  uint32_t nspheres_{0};
+  std::vector<Material> materials_;
+  std::vector<Ooc::Chunk> chunks_;
+  // chunks whose bounds overlap cell c: cell_chunks_[cell_offsets_[c],
+  // cell_offsets_[c + 1])
+  UniformGrid grid_;
+  std::vector<uint32_t> cell_offsets_;
+  std::vector<uint32_t> cell_chunks_;
+  // paging state; the mapping, LRU list and stats change under the
+  // exclusive lock only
+  mutable std::shared_mutex mutex_;
+  mutable std::vector<std::shared_ptr<const Resident>> resident_;
+  // used since last passed over for eviction
+  std::unique_ptr<std::atomic<bool>[]> referenced_;
+  mutable std::atomic<uint64_t> hits_{0};
+  mutable std::list<uint32_t> lru_; // most recently mapped or used first
+  mutable std::vector<std::list<uint32_t>::iterator> lru_pos_;
+  mutable OutOfCoreStats stats_;
+};
+
+#endif // OUT_OF_CORE_HPP_
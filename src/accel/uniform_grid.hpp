@@ -0,0 +1,155 @@
+#ifndef UNIFORM_GRID_HPP_
+#define UNIFORM_GRID_HPP_
+
+#include "aabb.hpp"
+#include "common.hpp"
+#include "ray.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <limits> // numeric_limits
+#include <vector>
+
+// cells of a uniform grid over a box and the walk of a ray through them
+// (3D-DDA, Amanatides & Woo); what the cells hold is up to the user
+struct UniformGrid {
+  Aabb bounds{};
+  int dims[3]{1, 1, 1};
+  float cell_size[3]{0, 0, 0};
+  float inv_cell_size[3]{0, 0, 0};
+  size_t ncells{1};
+
+  // cells of about equal size on all axes, density cells per item and at
+  // most max_cells
+  void Size(const Aabb& box, size_t nitems, float density, size_t max_cells) {
+    bounds = box;
+    dims[0] = dims[1] = dims[2] = 1;
+    ncells = 1;
+    if (nitems == 0)
+      return;
+    Vec3f extent = bounds.max - bounds.min;
+    float longest = std::max({extent.x, extent.y, extent.z, eps});
+    // flat scenes still get a volume
+    for (int a = 0; a < 3; ++a)
+      extent.xyz[a] = std::max(extent.xyz[a], longest * 1e-3f);
+    float volume = extent.x * extent.y * extent.z;
+    float per_length = std::cbrt(density * nitems / volume);
+    for (;;) {
+      size_t cells = 1;
+      for (int a = 0; a < 3; ++a) {
+        float n = std::ceil(extent.xyz[a] * per_length);
+        dims[a] = static_cast<int>(std::clamp(n, 1.0f, 4096.0f));
+        cells *= dims[a];
+      }
+      if (cells <= max_cells) break;
+      per_length *= 0.9f;
+    }
+    ncells = static_cast<size_t>(dims[0]) * dims[1] * dims[2];
+    for (int a = 0; a < 3; ++a) {
+      cell_size[a] = (bounds.max.xyz[a] - bounds.min.xyz[a]) / dims[a];
+      inv_cell_size[a] = cell_size[a] > 0 ? 1.0f / cell_size[a] : 0.0f;
+    }
+  }
+
+  int CellOf(const Vec3f& p, int axis) const {
+    float c = std::floor((p.xyz[axis] - bounds.min.xyz[axis]) *
+                         inv_cell_size[axis]);
+    return static_cast<int>(
+        std::clamp(c, 0.0f, static_cast<float>(dims[axis] - 1)));
+  }
+  size_t Index(int x, int y, int z) const {
+    return (static_cast<size_t>(z) * dims[1] + y) * dims[0] + x;
+  }
+  size_t IndexOf(const Vec3f& p) const {
+    return Index(CellOf(p, 0), CellOf(p, 1), CellOf(p, 2));
+  }
+
+  // call fn(cell) for every cell a box overlaps
+  template <typename F>
+  void ForEachCell(const Aabb& box, F&& fn) const {
+    int lo[3], hi[3];
+    for (int a = 0; a < 3; ++a) {
+      lo[a] = CellOf(box.min, a);
+      hi[a] = CellOf(box.max, a);
+    }
+    for (int z = lo[2]; z <= hi[2]; ++z)
+      for (int y = lo[1]; y <= hi[1]; ++y)
+        for (int x = lo[0]; x <= hi[0]; ++x)
+          fn(Index(x, y, z));
+  }
+
+  // call visit(cell, t_cell_exit) for every cell the ray crosses within
+  // [0, t_max], nearest first, until it returns true
+  template <typename F>
+  void Walk(const Ray& ray, float t_max, F&& visit) const {
+    float t_enter, t_exit;
+    if (bounds.Empty() || !bounds.Intersects(ray, t_max, t_enter, t_exit))
+      return;
+    Vec3f start = ray.origin + ray.dir * t_enter;
+    int cell[3], step[3];
+    float t_next[3], t_delta[3];
+    for (int a = 0; a < 3; ++a) {
+      cell[a] = CellOf(start, a);
+      float dir = ray.dir.xyz[a];
+      float cell_min = bounds.min.xyz[a] + cell[a] * cell_size[a];
+      if (dir > 0) {
+        step[a] = 1;
+        t_next[a] = (cell_min + cell_size[a] - ray.origin.xyz[a]) / dir;
+        t_delta[a] = cell_size[a] / dir;
+      } else if (dir < 0) {
+        step[a] = -1;
+        t_next[a] = (cell_min - ray.origin.xyz[a]) / dir;
+        t_delta[a] = -cell_size[a] / dir;
+      } else {
+        step[a] = 0;
+        t_next[a] = std::numeric_limits<float>::infinity();
+        t_delta[a] = std::numeric_limits<float>::infinity();
+      }
+    }
+    for (;;) {
+      int axis = t_next[0] < t_next[1] ? (t_next[0] < t_next[2] ? 0 : 2)
+                                       : (t_next[1] < t_next[2] ? 1 : 2);
+      if (visit(Index(cell[0], cell[1], cell[2]), t_next[axis]))
+        return;
+      if (t_next[axis] > t_exit) return;
+      cell[axis] += step[axis];
+      if (cell[axis] < 0 || cell[axis] >= dims[axis]) return;
+      t_next[axis] += t_delta[axis];
+    }
+  }
+};
+
+// marks of the items a query has visited while walking a grid whose items
+// overlap several cells, so each is tested once; the marks are per thread
+// and a query nested in another (e.g. in the prototype of an instance)
+// only makes the outer one visit some items again
+class VisitMarks {
+public:
+  explicit VisitMarks(size_t nitems) : marks_(Marks()) {
+    thread_local uint32_t last = 0;
+    if (marks_.size() < nitems) marks_.resize(nitems, 0);
+    if (++last == 0) {
+      std::fill(marks_.begin(), marks_.end(), 0);
+      last = 1;
+    }
+    stamp_ = last;
+  }
+  // false if the item was already visited by this query
+  bool Visit(uint32_t item) {
+    if (marks_[item] == stamp_) return false;
+    marks_[item] = stamp_;
+    return true;
+  }
+
+private:
+  static std::vector<uint32_t>& Marks() {
+    thread_local std::vector<uint32_t> marks;
+    return marks;
+  }
+
+  std::vector<uint32_t>& marks_;
+  uint32_t stamp_;
+};
+
+#endif // UNIFORM_GRID_HPP_
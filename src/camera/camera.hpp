@@ -6,6 +6,8 @@
 #include <cmath> // M_PI
 #include <utility>
 #include <array>
+#include <algorithm>
+#include <limits> // numeric_limits
 
 
 // pinhole camera model
@@ -27,7 +29,7 @@ public:
   Vec3f center() const { return center_; }
 
   // perspective (pinhole) transform
-  std::pair<Vec3i32, bool> Project(Vec3f point) {
+  std::pair<Vec3i32, bool> Project(Vec3f point) const {
     Vec3f point_c = World2Cam(point); // in camera (3D) coords
     // to camera plane (2D)
     auto projected =  
@@ -42,6 +44,31 @@ public:
     return std::make_pair(projected, is_visible);
   }
 
+  // camera plane rectangle [lo, hi] covering the projection of a world
+  // space box; false if the box reaches behind (or nearly level with)
+  // the camera, where the projection is unbounded
+  bool ProjectBox(const Vec3f& box_min, const Vec3f& box_max,
+                  Vec3i32& lo, Vec3i32& hi) const {
+    lo = Vec3i32{std::numeric_limits<int32_t>::max()};
+    hi = Vec3i32{std::numeric_limits<int32_t>::min()};
+    for (int corner = 0; corner < 8; ++corner) {
+      Vec3f p{(corner & 1) ? box_max.x : box_min.x,
+              (corner & 2) ? box_max.y : box_min.y,
+              (corner & 4) ? box_max.z : box_min.z};
+      Vec3f p_cam = World2Cam(p);
+      // keep the projected coordinates well within int range
+      constexpr float max_coord = 1e8f;
+      if (p_cam.z <= 0 ||
+          std::abs(focal_length_ * p_cam.x) >= max_coord * p_cam.z ||
+          std::abs(focal_length_ * p_cam.y) >= max_coord * p_cam.z)
+        return false;
+      auto projected = Project(p).first;
+      lo.x = std::min(lo.x, projected.x); lo.y = std::min(lo.y, projected.y);
+      hi.x = std::max(hi.x, projected.x); hi.y = std::max(hi.y, projected.y);
+    }
+    return true;
+  }
+
   // unproject a point from the camera plane to world coordinates
   Vec3f Unproject(float plane_x, float plane_y) const {
     // no need to use the inverse perspective transform as the point is
@@ -89,7 +116,7 @@ private:
 
   template <typename T>
   // world coordinates to camera-centered and rotated coordinates
-  Vec3f World2Cam(Xyz<T> point) {
+  Vec3f World2Cam(Xyz<T> point) const {
     // P_c = R(P_W - C)
     return rot_ * (point - center_);
   }
@@ -0,0 +1,37 @@
+#ifndef MAPPING_HPP_
+#define MAPPING_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <sys/mman.h> // mmap
+#include <unistd.h>   // sysconf
+
+// read-only mapping of a file region - offset needn't be page aligned
+class Mapping {
+public:
+  Mapping(int fd, uint64_t offset, size_t length) {
+    static const uint64_t page = sysconf(_SC_PAGESIZE);
+    uint64_t aligned = offset - offset % page;
+    length_ = length + (offset - aligned);
+    base_ = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd, aligned);
+    if (base_ == MAP_FAILED)
+      throw std::runtime_error("ERROR: Could not map file region");
+    // regions are read front to back
+    madvise(base_, length_, MADV_WILLNEED);
+    data_ = static_cast<const char*>(base_) + (offset - aligned);
+  }
+  ~Mapping() { munmap(base_, length_); }
+  Mapping(const Mapping&) = delete;
+  Mapping& operator=(const Mapping&) = delete;
+
+  const char* data() const { return data_; }
+  size_t length() const { return length_; }
+
+private:
+  void* base_{nullptr};
+  size_t length_{0};
+  const char* data_{nullptr};
+};
+
+#endif // MAPPING_HPP_
@@ -0,0 +1,103 @@
+#ifndef THREAD_POOL_HPP_
+#define THREAD_POOL_HPP_
+
+#include "timeline.hpp"
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+// fixed set of worker threads running submitted tasks in FIFO order
+class ThreadPool {
+public:
+  explicit ThreadPool(unsigned nthreads = std::thread::hardware_concurrency()) {
+    nthreads = std::max(1u, nthreads);
+    for (unsigned i = 0; i < nthreads; ++i)
+      workers_.emplace_back([this] { Work(); });
+  }
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    cv_.notify_all();
+    for (auto& worker : workers_) worker.join();
+  }
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  void Submit(std::function<void()> task) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      tasks_.push(std::move(task));
+    }
+    cv_.notify_one();
+  }
+  unsigned size() const { return workers_.size(); }
+
+private:
+  void Work() {
+    for (;;) {
+      std::function<void()> task;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cv_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+        if (stop_ && tasks_.empty()) return;
+        task = std::move(tasks_.front());
+        tasks_.pop();
+      }
+      TIMELINE_SCOPE("ThreadPool task");
+      task();
+    }
+  }
+
+  std::vector<std::thread> workers_;
+  std::queue<std::function<void()>> tasks_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stop_{false};
+};
+
+// counts down finished tasks so a caller can wait for its own batch
+// while the pool keeps running others
+class Latch {
+public:
+  explicit Latch(int count) : count_(count) {}
+  void CountDown() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (--count_ == 0) cv_.notify_all();
+  }
+  void Wait() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cv_.wait(lock, [this] { return count_ <= 0; });
+  }
+
+private:
+  int count_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+};
+
+// run fn(begin, end) over [0, n) split into about 4 ranges per thread
+// and wait for all of them - not to be called from a task of the same
+// pool, which could wait on itself
+template <typename F>
+void ParallelFor(ThreadPool& pool, int n, F&& fn) {
+  if (n <= 0) return;
+  int nranges = std::min<int>(n, pool.size() * 4);
+  Latch done(nranges);
+  for (int r = 0; r < nranges; ++r) {
+    int begin = static_cast<long>(n) * r / nranges;
+    int end = static_cast<long>(n) * (r + 1) / nranges;
+    pool.Submit([&fn, &done, begin, end] {
+      fn(begin, end);
+      done.CountDown();
+    });
+  }
+  done.Wait();
+}
+
+#endif // THREAD_POOL_HPP_
@@ -0,0 +1,190 @@
+#ifndef DENOISER_HPP_
+#define DENOISER_HPP_
+
+#include "common.hpp"
+#include "gbuffer.hpp"
+#include "thread_pool.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <utility>
+#include <vector>
+
+// Edge-aware a-trous wavelet filter (Dammertz et al., "Edge-avoiding
+// A-Trous wavelet transform for fast global illumination filtering").
+// Repeated 5x5 B3-spline blurs with growing holes between the taps,
+// weighted down across changes of color, normal, depth and albedo so that
+// noise is smoothed but object edges and texture are not.
+struct DenoiseParams {
+  int iterations{3};          // passes with tap spacing 1, 2, 4, ...
+  float sigma_color{0.15f};   // color distance, colors in [0, 1]
+  float sigma_normal{0.1f};   // 1 - cos of the angle between normals
+  float sigma_depth{0.02f};   // relative depth difference
+  float sigma_albedo{0.05f};  // albedo distance, colors in [0, 1]
+};
+
+namespace Denoiser {
+
+// per-pixel data as separate float planes so that the inner loops run
+// over contiguous arrays and vectorize
+struct Planes {
+  explicit Planes(size_t n) : r(n), g(n), b(n) {}
+  std::vector<float> r, g, b;
+};
+
+struct Guides {
+  explicit Guides(size_t n)
+      : nx(n), ny(n), nz(n), depth(n), inv_depth(n), albedo(n) {}
+  std::vector<float> nx, ny, nz;
+  // 0 on the background - hits are always in front of the camera, so
+  // this also tells objects from the background
+  std::vector<float> depth, inv_depth;
+  Planes albedo;
+};
+
+inline Guides MakeGuides(const GBuffer& gbuffer) {
+  Guides ret(gbuffer.data.size());
+  for (size_t i = 0; i < gbuffer.data.size(); ++i) {
+    const auto& s = gbuffer.data[i];
+    // the background gets the same normal and depth everywhere so that
+    // it is smoothed with itself but not with the objects
+    ret.nx[i] = s.hit ? s.normal.x : 1.0f;
+    ret.ny[i] = s.hit ? s.normal.y : 0.0f;
+    ret.nz[i] = s.hit ? s.normal.z : 0.0f;
+    ret.depth[i] = s.hit ? s.t : 0.0f;
+    ret.inv_depth[i] = s.hit ? 1.0f / s.t : 0.0f;
+    ret.albedo.r[i] = s.albedo.x / 255.0f;
+    ret.albedo.g[i] = s.albedo.y / 255.0f;
+    ret.albedo.b[i] = s.albedo.z / 255.0f;
+  }
+  return ret;
+}
+
+// pixels of a row filtered at a time; the center pixels of a block and
+// their accumulators stay in L1 while the 25 taps are summed
+constexpr int block_size = 256;
+
+// one a-trous pass over rows [row_begin, row_end)
+inline void FilterRows(const Planes& in, Planes& out, const Guides& guides,
+                       int w, int h, int step, const DenoiseParams& params,
+                       float inv_sigma_color, int row_begin, int row_end) {
+  // B3-spline taps by distance from the center
+  constexpr float kernel[3] = {3.0f / 8.0f, 1.0f / 4.0f, 1.0f / 16.0f};
+  const float inv_normal = 1.0f / params.sigma_normal;
+  const float inv_depth = 1.0f / (params.sigma_depth * params.sigma_depth);
+  const float inv_albedo = 1.0f / (params.sigma_albedo * params.sigma_albedo);
+  float acc_r[block_size], acc_g[block_size], acc_b[block_size],
+      acc_w[block_size];
+  const float *r = in.r.data(), *g = in.g.data(), *b = in.b.data();
+  const float *nx = guides.nx.data(), *ny = guides.ny.data(),
+              *nz = guides.nz.data();
+  const float *z = guides.depth.data(), *inv_z = guides.inv_depth.data();
+  const float *ar = guides.albedo.r.data(), *ag = guides.albedo.g.data(),
+              *ab = guides.albedo.b.data();
+
+  for (int y = row_begin; y < row_end; ++y) {
+    for (int x0 = 0; x0 < w; x0 += block_size) {
+      const int n = std::min(block_size, w - x0);
+      std::fill(acc_r, acc_r + n, 0.0f);
+      std::fill(acc_g, acc_g + n, 0.0f);
+      std::fill(acc_b, acc_b + n, 0.0f);
+      std::fill(acc_w, acc_w + n, 0.0f);
+      for (int dy = -2; dy <= 2; ++dy) {
+        int yy = y + dy * step;
+        if (yy < 0 || yy >= h) continue;
+        for (int dx = -2; dx <= 2; ++dx) {
+          const float k = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+          const int off = dx * step;
+          // taps falling off the image are left out
+          const int i_begin = std::max(0, -off - x0);
+          const int i_end = std::min(n, w - off - x0);
+          // block of the center pixels (p) and of the tap pixels (q)
+          const size_t p0 = static_cast<size_t>(y) * w + x0;
+          const size_t q0 = static_cast<size_t>(yy) * w + x0 + off;
+          const float *rp = r + p0, *gp = g + p0, *bp = b + p0;
+          const float *rq = r + q0, *gq = g + q0, *bq = b + q0;
+          const float *nxp = nx + p0, *nyp = ny + p0, *nzp = nz + p0;
+          const float *nxq = nx + q0, *nyq = ny + q0, *nzq = nz + q0;
+          const float *zp = z + p0, *zq = z + q0, *inv_zp = inv_z + p0;
+          const float *arp = ar + p0, *agp = ag + p0, *abp = ab + p0;
+          const float *arq = ar + q0, *agq = ag + q0, *abq = ab + q0;
+          // the accumulators never alias the inputs; without the hint gcc
+          // gives up on the many run-time alias checks and won't vectorize
+#pragma GCC ivdep
+          for (int i = i_begin; i < i_end; ++i) {
+            float dr = rp[i] - rq[i], dg = gp[i] - gq[i], db = bp[i] - bq[i];
+            float d_color = dr * dr + dg * dg + db * db;
+            float d_normal = 1.0f - (nxp[i] * nxq[i] + nyp[i] * nyq[i] +
+                                     nzp[i] * nzq[i]);
+            float dz = (zp[i] - zq[i]) * inv_zp[i];
+            float dar = arp[i] - arq[i], dag = agp[i] - agq[i],
+                  dab = abp[i] - abq[i];
+            float d_albedo = dar * dar + dag * dag + dab * dab;
+            float hit_p = zp[i] > 0.0f ? 1.0f : 0.0f;
+            float hit_q = zq[i] > 0.0f ? 1.0f : 0.0f;
+            float same_kind = 1.0f - std::abs(hit_p - hit_q);
+            // rational edge-stopping functions - unlike exp() they
+            // vectorize; multiplied pairwise to shorten the dependency
+            // chain ending in the division
+            float weight = k * same_kind /
+                           (((1.0f + d_color * inv_sigma_color) *
+                             (1.0f + std::max(d_normal, 0.0f) * inv_normal)) *
+                            ((1.0f + dz * dz * inv_depth) *
+                             (1.0f + d_albedo * inv_albedo)));
+            acc_r[i] += weight * rq[i];
+            acc_g[i] += weight * gq[i];
+            acc_b[i] += weight * bq[i];
+            acc_w[i] += weight;
+          }
+        }
+      }
+      // the center tap always has a non-zero weight
+      const size_t p0 = static_cast<size_t>(y) * w + x0;
+      for (int i = 0; i < n; ++i) {
+        float inv_w = 1.0f / acc_w[i];
+        out.r[p0 + i] = acc_r[i] * inv_w;
+        out.g[p0 + i] = acc_g[i] * inv_w;
+        out.b[p0 + i] = acc_b[i] * inv_w;
+      }
+    }
+  }
+}
+
+} // namespace Denoiser
+
+// filter a rendered image guided by the G-buffer of the same frame
+// (RayTracer::CaptureGBuffer), splitting the rows over the pool's threads
+inline Image Denoise(const Image& image, const GBuffer& gbuffer,
+                     ThreadPool& pool, const DenoiseParams& params = {}) {
+  if (gbuffer.width != image.width || gbuffer.height != image.height)
+    throw std::invalid_argument("Denoise: G-buffer and image sizes differ");
+  const int w = image.width, h = image.height;
+  const size_t n = image.data.size();
+  Denoiser::Planes in(n), out(n);
+  for (size_t i = 0; i < n; ++i) {
+    in.r[i] = image.data[i].x / 255.0f;
+    in.g[i] = image.data[i].y / 255.0f;
+    in.b[i] = image.data[i].z / 255.0f;
+  }
+  const auto guides = Denoiser::MakeGuides(gbuffer);
+  float inv_sigma_color = 1.0f / (params.sigma_color * params.sigma_color);
+  for (int it = 0, step = 1; it < params.iterations; ++it, step *= 2) {
+    ParallelFor(pool, h, [&](int row_begin, int row_end) {
+      Denoiser::FilterRows(in, out, guides, w, h, step, params,
+                           inv_sigma_color, row_begin, row_end);
+    });
+    std::swap(in, out);
+    // coarser passes only smooth what's left of the finer detail
+    inv_sigma_color *= 4.0f;
+  }
+  Image ret(w, h);
+  for (size_t i = 0; i < n; ++i) {
+    auto to_u8 = [](float c) {
+      return static_cast<uint8_t>(std::clamp(c * 255.0f + 0.5f, 0.0f, 255.0f));
+    };
+    ret.data[i] = Vec3u8{to_u8(in.r[i]), to_u8(in.g[i]), to_u8(in.b[i])};
+  }
+  return ret;
+}
+
+#endif // DENOISER_HPP_
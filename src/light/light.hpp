@@ -4,8 +4,14 @@
 #include "ray.hpp"
 #include "vec.hpp"
 #include "objects.hpp"
+#include "accelerator.hpp"
 #include "camera.hpp"
 #include "common.hpp"
+#include "fast_math.hpp"
+#include "render_cost.hpp"
+#include "light_table.hpp"
+#include "shadow_map.hpp"
+#include "timeline.hpp"
 #include <vector>
 #include <optional>
 #include <algorithm>
@@ -41,74 +47,138 @@ public:
                             .data = Vec3f{dirx, diry, dirz}.Unit()});
   }
 
+  size_t size() const { return lights_.size(); }
+  // edit an added light, e.g. its intensity or position for relighting
+  Light& operator[](size_t i) { return lights_.at(i); }
+  const Light& operator[](size_t i) const { return lights_.at(i); }
+
+  // FAST trades a little accuracy of the specular term for speed
+  void SetMathMode(MathMode mode) { math_mode_ = mode; }
+  MathMode math_mode() const { return math_mode_; }
+
+  // answer the shadow queries of directional lights from depth maps of
+  // resolution x resolution texels instead of tracing shadow rays;
+  // pcf_radius > 0 averages (2 * pcf_radius + 1)^2 lookups to soften
+  // the shadow edges. A resolution of 0 goes back to shadow rays
+  void UseShadowMaps(int resolution, int pcf_radius = 1) {
+    if (resolution < 0 || pcf_radius < 0)
+      throw std::invalid_argument("UseShadowMaps: negative size");
+    shadow_map_resolution_ = resolution;
+    pcf_radius_ = pcf_radius;
+    shadow_maps_.clear();
+  }
+  int shadow_map_resolution() const { return shadow_map_resolution_; }
+  int pcf_radius() const { return pcf_radius_; }
+
+  // split the lights by type for shading and render the shadow maps;
+  // once per frame, after the scene or the lights have changed
+  void Prepare(const Accelerator& scene) {
+    TIMELINE_SCOPE("Lights::Prepare");
+    BuildTable();
+    BuildShadowMaps(scene);
+  }
+
   // call it having added all lights to normalize their intensities
   void Normalize() {
+    TIMELINE_SCOPE("Lights::Normalize");
     float total = 0.0;
     for (const auto &light: lights_) total += light.intensity;
-    if (std::abs(total) < eps) return;
+    // already normalized - dividing again by a sum off by rounding would
+    // drift the intensities a little every frame
+    if (std::abs(total) < eps || std::abs(total - 1.0f) < 1e-6f) return;
     for (auto &light: lights_) light.intensity /= total;
   }
 
-  // diffuse and specular light contribution at a point on an object
-  Vec3u8 ColorAt(const std::vector<Sphere>& objects,
+  // diffuse and specular light contribution at a point on an object;
+  // Prepare must have been called since the lights were last edited -
+  // lights added after it are left out until the next one
+  Vec3u8 ColorAt(const Accelerator& scene,
                  const Sphere &sphere,
+                 ObjectId id,
                  const Vec3f &at,
                  const Camera &camera) const {
-    float diffuse_intensity = 0.0;
-    float specular_intensity = 0.0;
     Vec3f N = sphere.NormalAt(at);
-    Vec3f view_dir = (camera.center() - at).Unit();
-  
-    for (const auto &light: lights_) {
-      if (light.type == LightType::AMBIENT) {
-        diffuse_intensity += light.intensity;
-        continue; // ambient light isn't affected by shadows
-      }
-    
-      // check for shadows before computing diffuse/specular component
-      float shadow_brightness = ShadowFactor(light, objects,
-                                             sphere, at, N);
-      if (shadow_brightness < eps)
-        continue; // fully occluded - save computation time
-    
-      /*
-       * D ___\___              D: directional source     
-       *      \___\___          P: point source
-       *          \___\___      N: normal      
-       *              \___\___              ^N
-       *                  \____\___        / 
-       *                       \___\___    | 
-       *   _______                 \___\__/   *****         
-       * P __     \_____________       \__*************     
-       *     \___               \_______*****************   
-       *         \___                  *******************  
-       *             \__              ********************* 
-       *                \___          ********************* 
-       *                    \___     ***********************
-       *                        \___  ********************* 
-       *                            \_********************* 
-       */
-      // diffuse light direction 
-      Vec3f light_dir = (light.type == LightType::POINT) 
-                        ? (*light.data - at).Unit()
-                        : *light.data;
-    
-      // ref: 
-      // gabrielgambetta.com/computer-graphics-from-scratch/03-light.html
-      float ndotl = std::max(N.Dot(light_dir), 0.0f);
-      const bool normal_facing_light = N.Dot(light_dir) > 0;
-      if (normal_facing_light) {
-        diffuse_intensity += light.intensity * ndotl * shadow_brightness;
+    const bool fast = math_mode_ == MathMode::FAST;
+    Vec3f view_dir = fast ? FastMath::Unit(camera.center() - at)
+                          : (camera.center() - at).Unit();
+    // terms of each light, summed in the order the lights were added;
+    // ambient light isn't affected by shadows
+    thread_local std::vector<float> diffuse_terms, specular_terms;
+    thread_local std::vector<float> n_dot_l, r_dot_v;
+    // sized by the table so that lights added since Prepare are skipped
+    // rather than read past its end
+    const size_t nlights = table_.ambient.size();
+    diffuse_terms = table_.ambient;
+    specular_terms.assign(nlights, 0.0f);
+
+    /*
+     * D ___\___              D: directional source     
+     *      \___\___          P: point source
+     *          \___\___      N: normal      
+     *              \___\___              ^N
+     *                  \____\___        / 
+     *                       \___\___    | 
+     *   _______                 \___\__/   *****         
+     * P __     \_____________       \__*************     
+     *     \___               \_______*****************   
+     *         \___                  *******************  
+     *             \__              ********************* 
+     *                \___          ********************* 
+     *                    \___     ***********************
+     *                        \___  ********************* 
+     *                            \_********************* 
+     */
+    // ref: 
+    // gabrielgambetta.com/computer-graphics-from-scratch/03-light.html
+    // unoccluded terms of all lights of a type at once, then shadows
+    // only for the lights facing the surface
+    const Vec3f n_unit = N.Unit();
+    for (const LightArray* array : {&table_.directional, &table_.point}) {
+      const bool point = array == &table_.point;
+      n_dot_l.resize(array->size());
+      r_dot_v.resize(array->size());
+      if (point && fast)
+        LightCosines<true, true>(*array, at, N, n_unit, view_dir,
+                                 n_dot_l.data(), r_dot_v.data());
+      else if (point)
+        LightCosines<true, false>(*array, at, N, n_unit, view_dir,
+                                  n_dot_l.data(), r_dot_v.data());
+      else if (fast)
+        LightCosines<false, true>(*array, at, N, n_unit, view_dir,
+                                  n_dot_l.data(), r_dot_v.data());
+      else
+        LightCosines<false, false>(*array, at, N, n_unit, view_dir,
+                                   n_dot_l.data(), r_dot_v.data());
+      for (size_t j = 0; j < array->size(); ++j) {
+        // facing away - no contribution whether in shadow or not
+        if (n_dot_l[j] <= 0)
+          continue;
+        const uint32_t i = array->index[j];
+        const ShadowMap* shadow_map =
+            (i < shadow_maps_.size() && shadow_maps_[i]) ? &*shadow_maps_[i]
+                                                         : nullptr;
+        float shadow_brightness = ShadowFactor(lights_[i], shadow_map, scene,
+                                               id, at, N);
+        if (shadow_brightness < eps)
+          continue; // fully occluded
+        const float intensity = array->intensity[j];
+        diffuse_terms[i] = intensity * n_dot_l[j] * shadow_brightness;
         if (sphere.material.specular > 0) {
-          Vec3f reflected = light_dir.ReflectAbout(N).Unit();
-          float refl_dot_view = std::max(reflected.Dot(view_dir), 0.0f);
-          specular_intensity += light.intensity *
-                                std::pow(refl_dot_view, sphere.material.specular) *
-                                shadow_brightness;
+          float refl_dot_view = std::max(r_dot_v[j], 0.0f);
+          float shininess = fast
+              ? FastMath::Pow(refl_dot_view, sphere.material.specular)
+              : std::pow(refl_dot_view, sphere.material.specular);
+          specular_terms[i] = intensity * shininess * shadow_brightness;
         }
       }
     }
-  
+
+    float diffuse_intensity = 0.0;
+    float specular_intensity = 0.0;
+    for (size_t i = 0; i < nlights; ++i) {
+      diffuse_intensity += diffuse_terms[i];
+      specular_intensity += specular_terms[i];
+    }
     diffuse_intensity = std::min(diffuse_intensity, 1.0f);
     specular_intensity = std::min(specular_intensity, 1.0f);
     uint8_t r = sphere.material.color.x;
@@ -126,12 +196,52 @@ public:
 
 private:
   std::vector<Light> lights_;
+  MathMode math_mode_{MathMode::PRECISE};
+  int shadow_map_resolution_{0}; // 0: shadow rays
+  int pcf_radius_{1};
+  // by light index, only for directional lights
+  std::vector<std::optional<ShadowMap>> shadow_maps_;
+  LightTable table_;
 
-  static float ShadowFactor(const Light& light,
-                            const std::vector<Sphere>& objects,
-                            const Sphere& sphere,
-                            const Vec3f& at,
-                            const Vec3f& normal) {
+  void BuildTable() {
+    table_.point.Clear();
+    table_.directional.Clear();
+    table_.ambient.assign(lights_.size(), 0.0f);
+    for (uint32_t i = 0; i < lights_.size(); ++i) {
+      const auto& light = lights_[i];
+      switch (light.type) {
+        case LightType::AMBIENT:
+          table_.ambient[i] = light.intensity;
+          break;
+        case LightType::POINT:
+          table_.point.Push(*light.data, light.intensity, i);
+          break;
+        case LightType::DIRECTIONAL:
+          table_.directional.Push(*light.data, light.intensity, i);
+          break;
+      }
+    }
+  }
+
+  // render the maps of the directional lights
+  void BuildShadowMaps(const Accelerator& scene) {
+    shadow_maps_.clear();
+    if (shadow_map_resolution_ == 0) return;
+    shadow_maps_.resize(lights_.size());
+    for (size_t i = 0; i < lights_.size(); ++i) {
+      if (lights_[i].type != LightType::DIRECTIONAL) continue;
+      shadow_maps_[i].emplace();
+      shadow_maps_[i]->Build(scene, *lights_[i].data, shadow_map_resolution_);
+    }
+  }
+
+
+  float ShadowFactor(const Light& light,
+                     const ShadowMap* shadow_map,
+                     const Accelerator& scene,
+                     ObjectId id,
+                     const Vec3f& at,
+                     const Vec3f& normal) const {
     // shift up the origin a bit to avoid self-intersection
     // (shadow acne) and multiply by eps * n to kill speckles          
     Vec3f origin = at + (normal - at) * eps * 4.0f; 
@@ -160,22 +270,14 @@ private:
       Vec3f hemi = (normal.Dot(dir_to_light) > 0 ? normal : -normal);
       origin = at + hemi * eps * 4.0f;
       Ray shadow_ray(origin, *light.data);
+      ++ray_cost.shadow_rays;
       float light_dist = (*light.data - origin).Norm();
       
-      float t_nearest = std::numeric_limits<float>::infinity();
-      bool any_hit = false;
-      for (const auto &obj : objects) {
-        // skip self-intersection
-        if (&obj == &sphere) continue;
-        HitRecord hit = obj.Intersects(shadow_ray);
-        // check if object blocks the light (0 < t < light_distance)
-        // i.e. object is between surface and the point source
-        if (hit.is_hit && hit.t > 0 && hit.t < light_dist) {
-          any_hit = true;
-          if (hit.t < t_nearest)
-            t_nearest = hit.t;
-        }
-      }
+      // nearest object (except self) that blocks the light, i.e. lies
+      // between the surface and the point source (0 < t < light_distance)
+      auto blocker = scene.Closest(shadow_ray, id, light_dist);
+      bool any_hit = blocker.is_hit;
+      float t_nearest = blocker.hit.t;
       if (!any_hit)
         return bright_max;
 
@@ -190,6 +292,15 @@ private:
       // normalized distance from target to source
       float u = std::clamp(t_nearest / light_dist, 0.0f, 1.0f);
       ret = ndotl * u;
+    } else if (light.type == LightType::DIRECTIONAL && shadow_map) {
+      // fraction of the filter's texels holding something between the
+      // surface and the light
+      float occlusion = shadow_map->Occlusion(at, normal, pcf_radius_);
+      if (occlusion <= 0.0f)
+        return bright_max;
+      // heuristic (2) below, blended over the filter footprint
+      float shadowed = std::clamp(normal.Dot(*light.data), 0.0f, 1.0f);
+      ret = bright_max + (shadowed - bright_max) * occlusion;
     } else if (light.type == LightType::DIRECTIONAL) {
       // push origin along the normal hemisphere w.r.t. light direction
       Vec3f hemi = (normal.Dot(*light.data) > 0 ? normal : -normal);
@@ -197,14 +308,13 @@ private:
       Ray shadow_ray {origin, {}};
       // shadow ray has travels in the opposite direction as the light
       shadow_ray.dir = -*light.data;
+      ++ray_cost.shadow_rays;
       
       // if the shadow ray intersects another object, cast a shadow
       // for directional lights, any hit with t > 0 means shadow
-      bool any_hit = std::any_of(objects.begin(), objects.end(),
-                     [&](const auto& obj) {
-                       if (&obj == &sphere) return false;
-                       auto hit = obj.Intersects(shadow_ray);
-                       if (!hit.is_hit || hit.t <= 0) return false;
+      bool any_hit = scene.AnyHit(shadow_ray, id,
+                     std::numeric_limits<float>::infinity(),
+                     [&](const Sphere& obj, const HitRecord& hit) {
                        // normal of the other object at intersection
                        Vec3f n_other = obj.NormalAt(hit.where);
                        // occlusion - one object is inside another
@@ -0,0 +1,85 @@
+#ifndef LIGHT_TABLE_HPP_
+#define LIGHT_TABLE_HPP_
+
+#include "fast_math.hpp"
+#include "vec.hpp"
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// lights of one type as parallel arrays so that shading goes over all of
+// them in one loop the compiler can vectorize
+struct LightArray {
+  // position for point lights, unit direction to the light for
+  // directional ones
+  std::vector<float> x, y, z;
+  std::vector<float> intensity;
+  std::vector<uint32_t> index; // in the order the lights were added
+
+  void Clear() {
+    x.clear(); y.clear(); z.clear();
+    intensity.clear();
+    index.clear();
+  }
+  void Push(const Vec3f& v, float light_intensity, uint32_t light_index) {
+    x.push_back(v.x); y.push_back(v.y); z.push_back(v.z);
+    intensity.push_back(light_intensity);
+    index.push_back(light_index);
+  }
+  size_t size() const { return index.size(); }
+};
+
+// the lights of a frame split by type
+struct LightTable {
+  LightArray point;
+  LightArray directional;
+  // per light in the order added - the ambient intensity or 0; shading
+  // starts its per-light terms from it
+  std::vector<float> ambient;
+};
+
+// for every light of an array, n_dot_l = N.L and r_dot_v = R.V, where L
+// is the unit vector to the light, R its reflection about the normal
+// (n_unit = N.Unit(), as ReflectAbout takes it) and V the unit vector to
+// the viewer. The arithmetic is Vec3's step by step so the results are
+// the same as computing them light by light.
+template <bool kPoint, bool kFast>
+void LightCosines(const LightArray& lights, const Vec3f& at, const Vec3f& N,
+                  const Vec3f& n_unit, const Vec3f& view, float* n_dot_l,
+                  float* r_dot_v) {
+  const float* px = lights.x.data();
+  const float* py = lights.y.data();
+  const float* pz = lights.z.data();
+  const int n = static_cast<int>(lights.size());
+  for (int i = 0; i < n; ++i) {
+    float lx = px[i], ly = py[i], lz = pz[i];
+    if constexpr (kPoint) {
+      lx -= at.x; ly -= at.y; lz -= at.z;
+      float norm_sq = lx * lx + ly * ly + lz * lz;
+      if constexpr (kFast) {
+        float inv = FastMath::Rsqrt(norm_sq);
+        lx *= inv; ly *= inv; lz *= inv;
+      } else {
+        float norm = std::sqrt(norm_sq);
+        lx /= norm; ly /= norm; lz /= norm;
+      }
+    }
+    n_dot_l[i] = lx * N.x + ly * N.y + lz * N.z;
+    // Vec3::ReflectAbout
+    double v = lx * n_unit.x + ly * n_unit.y + lz * n_unit.z;
+    float rx = static_cast<float>(lx - 2 * v * n_unit.x);
+    float ry = static_cast<float>(ly - 2 * v * n_unit.y);
+    float rz = static_cast<float>(lz - 2 * v * n_unit.z);
+    float r_sq = rx * rx + ry * ry + rz * rz;
+    if constexpr (kFast) {
+      float inv = FastMath::Rsqrt(r_sq);
+      rx *= inv; ry *= inv; rz *= inv;
+    } else {
+      float norm = std::sqrt(r_sq);
+      rx /= norm; ry /= norm; rz /= norm;
+    }
+    r_dot_v[i] = rx * view.x + ry * view.y + rz * view.z;
+  }
+}
+
+#endif // LIGHT_TABLE_HPP_
@@ -0,0 +1,146 @@
+#ifndef SHADOW_MAP_HPP_
+#define SHADOW_MAP_HPP_
+
+#include "accelerator.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <cmath>
+#include <limits> // numeric_limits
+#include <vector>
+
+// Orthographic depth map of the scene seen from a directional light.
+// Each texel keeps how far towards the light the nearest-to-light surface
+// over it reaches, so a point is in shadow if a texel over it holds a
+// surface further towards the light than the point itself.
+class ShadowMap {
+public:
+  // rasterize the spheres of the scene along the light direction;
+  // to_light must be a unit vector pointing towards the light
+  void Build(const Accelerator& scene, const Vec3f& to_light,
+             int resolution) {
+    to_light_ = to_light;
+    // orthonormal basis of the map plane
+    Vec3f helper = std::abs(to_light.x) < 0.9f ? Vec3f{1, 0, 0}
+                                               : Vec3f{0, 1, 0};
+    u_ = helper.Cross(to_light).Unit();
+    v_ = to_light.Cross(u_);
+    std::vector<Sphere> spheres;
+    spheres.reserve(scene.size());
+    for (ObjectId id = 0; id < scene.size(); ++id)
+      spheres.push_back(scene.At(id));
+    resolution_ = std::max(1, resolution);
+    depth_.assign(resolution_ * resolution_,
+                  -std::numeric_limits<float>::infinity());
+    // an object is only shadowed by the others and its shadow falls in its
+    // own footprint on the map plane, so the map needs to cover where each
+    // footprint overlaps the others - a huge ground sphere doesn't stretch
+    // it over the whole plane
+    const size_t n = spheres.size();
+    std::vector<Rect> footprints(n), before(n + 1), after(n + 1);
+    for (size_t i = 0; i < n; ++i) {
+      float cu = spheres[i].center.Dot(u_), cv = spheres[i].center.Dot(v_);
+      float r = spheres[i].radius;
+      footprints[i] = Rect{cu - r, cu + r, cv - r, cv + r};
+      before[i + 1] = before[i].Union(footprints[i]);
+    }
+    for (size_t i = n; i-- > 0;)
+      after[i] = after[i + 1].Union(footprints[i]);
+    Rect bounds;
+    for (size_t i = 0; i < n; ++i) {
+      Rect others = before[i].Union(after[i + 1]);
+      bounds = bounds.Union(footprints[i].Intersection(others));
+    }
+    if (bounds.Empty()) {
+      texel_ = 0; // nothing can be shadowed
+      return;
+    }
+    origin_u_ = bounds.u_min;
+    origin_v_ = bounds.v_min;
+    texel_ = std::max({bounds.u_max - bounds.u_min,
+                       bounds.v_max - bounds.v_min, eps}) / resolution_;
+
+    for (const auto& s : spheres) {
+      float cu = s.center.Dot(u_), cv = s.center.Dot(v_);
+      float cl = s.center.Dot(to_light_);
+      int i0 = std::max(0, TexelOf(cu - s.radius, origin_u_));
+      int i1 = std::min(resolution_ - 1, TexelOf(cu + s.radius, origin_u_));
+      int j0 = std::max(0, TexelOf(cv - s.radius, origin_v_));
+      int j1 = std::min(resolution_ - 1, TexelOf(cv + s.radius, origin_v_));
+      for (int j = j0; j <= j1; ++j) {
+        float dv = origin_v_ + (j + 0.5f) * texel_ - cv;
+        for (int i = i0; i <= i1; ++i) {
+          float du = origin_u_ + (i + 0.5f) * texel_ - cu;
+          float d2 = s.radius * s.radius - du * du - dv * dv;
+          if (d2 < 0) continue;
+          // the sphere's surface facing the light
+          float& texel = depth_[j * resolution_ + i];
+          texel = std::max(texel, cl + std::sqrt(d2));
+        }
+      }
+    }
+  }
+
+  // fraction in [0, 1] of the (2 * pcf_radius + 1)^2 texels around a
+  // surface point that hold something nearer the light than the point
+  float Occlusion(const Vec3f& at, const Vec3f& normal,
+                  int pcf_radius) const {
+    if (depth_.empty() || texel_ <= 0) return 0.0f;
+    int ci = TexelOf(at.Dot(u_), origin_u_);
+    int cj = TexelOf(at.Dot(v_), origin_v_);
+    float depth = at.Dot(to_light_);
+    // slope-scaled bias - a surface tilted away from the light changes
+    // depth quickly across the texels it is compared against
+    float cos_l = std::max(normal.Dot(to_light_), 0.05f);
+    float tan_l = std::min(std::sqrt(1.0f - cos_l * cos_l) / cos_l, 10.0f);
+    float bias = texel_ * (1.0f + pcf_radius) * (1.0f + tan_l);
+    int occluded = 0, total = 0;
+    for (int j = cj - pcf_radius; j <= cj + pcf_radius; ++j) {
+      for (int i = ci - pcf_radius; i <= ci + pcf_radius; ++i) {
+        ++total;
+        // nothing outside of the map
+        if (i < 0 || j < 0 || i >= resolution_ || j >= resolution_) continue;
+        occluded += depth_[j * resolution_ + i] > depth + bias;
+      }
+    }
+    return static_cast<float>(occluded) / total;
+  }
+
+private:
+  static constexpr float eps = 1e-3f;
+
+  // axis-aligned rectangle on the map plane
+  struct Rect {
+    float u_min{std::numeric_limits<float>::infinity()};
+    float u_max{-std::numeric_limits<float>::infinity()};
+    float v_min{std::numeric_limits<float>::infinity()};
+    float v_max{-std::numeric_limits<float>::infinity()};
+    bool Empty() const { return u_min > u_max || v_min > v_max; }
+    Rect Union(const Rect& o) const {
+      if (Empty()) return o;
+      if (o.Empty()) return *this;
+      return {std::min(u_min, o.u_min), std::max(u_max, o.u_max),
+              std::min(v_min, o.v_min), std::max(v_max, o.v_max)};
+    }
+    Rect Intersection(const Rect& o) const {
+      Rect ret{std::max(u_min, o.u_min), std::min(u_max, o.u_max),
+               std::max(v_min, o.v_min), std::min(v_max, o.v_max)};
+      return ret.Empty() ? Rect{} : ret;
+    }
+  };
+
+  // clamped to one texel past either edge so huge spheres don't overflow
+  int TexelOf(float coord, float origin) const {
+    float texel = std::floor((coord - origin) / texel_);
+    return static_cast<int>(std::clamp(texel, -1.0f,
+                                       static_cast<float>(resolution_)));
+  }
+
+  Vec3f to_light_{};
+  Vec3f u_{}, v_{}; // map plane axes
+  float origin_u_{0}, origin_v_{0};
+  float texel_{0}; // world size of a texel
+  int resolution_{0};
+  std::vector<float> depth_;
+};
+
+#endif // SHADOW_MAP_HPP_
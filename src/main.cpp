@@ -1,10 +1,32 @@
 #include "camera.hpp"
+#include "denoiser.hpp"
 #include "light.hpp"
 #include "ppm_writer.hpp"
 #include "ray_tracer.hpp"
+#include "thread_pool.hpp"
+#include "timeline.hpp"
 #include "vec.hpp"
+#include <chrono>
+#include <cstdio>
+#include <string>
 
-int main() {
+int main(int argc, char** argv) {
+  // ./demo [--cost-map] [--denoise]
+  //   --cost-map  also write a heatmap of the time spent per pixel; timing
+  //               every pixel slows the render down
+  //   --denoise   filter the frame guided by its G-buffer before saving it
+  bool cost_map = false, denoise = false;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "--cost-map") {
+      cost_map = true;
+    } else if (arg == "--denoise") {
+      denoise = true;
+    } else {
+      std::fprintf(stderr, "usage: %s [--cost-map] [--denoise]\n", argv[0]);
+      return 1;
+    }
+  }
   Camera cam(400, 100, 80, {0, 0, -200}, {0.2, -0.2, 0.4});
   
   // Large red sphere in the center back
@@ -80,6 +102,27 @@ int main() {
   ray_tracer.AddObject(sphere5);
   ray_tracer.AddObject(sphere6);
   
+  if (cost_map)
+    ray_tracer.EnableCostMap(CostMetric::TIME_NS);
+  if (denoise)
+    ray_tracer.CaptureGBuffer();
+  auto start = std::chrono::steady_clock::now();
   ray_tracer.Trace(5);
-  Ppm::SaveAs(ray_tracer.image(), "output6.ppm");
+  Image image = ray_tracer.image();
+  if (denoise) {
+    auto traced = std::chrono::steady_clock::now();
+    ThreadPool pool;
+    image = Denoise(image, ray_tracer.gbuffer(), pool);
+    auto seconds = [](auto from, auto to) {
+      return std::chrono::duration<double>(to - from).count();
+    };
+    double render_s = seconds(start, traced);
+    double denoise_s = seconds(traced, std::chrono::steady_clock::now());
+    std::printf("render %.3f s, denoise %.3f s (%.0f%% of the render)\n",
+                render_s, denoise_s, 100 * denoise_s / render_s);
+  }
+  Ppm::SaveAs(image, "output6.ppm");
+  if (cost_map)
+    Ppm::SaveAs(ray_tracer.CostHeatmap(), "output6_cost.ppm");
+  TIMELINE_DUMP("timeline.json");
 }
@@ -121,7 +121,8 @@ template <typename T> struct Xyz {
   float Norm() const { return std::sqrt(NormSq()); }
 
   Xyz<float> Unit() const {
-    return Xyz<float>{x / Norm(), y / Norm(), z / Norm()};
+    const float norm = Norm();
+    return Xyz<float>{x / norm, y / norm, z / norm};
   }
 
   float Cos(const Xyz<T> &other) const {
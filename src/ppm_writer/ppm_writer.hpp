@@ -2,6 +2,7 @@
 #define PPM_WRITER
 
 #include "common.hpp"
+#include "timeline.hpp"
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
@@ -13,6 +14,7 @@ namespace Ppm {
 
 static void SaveAs(const Image &mat,
                    const std::string &filename = "output.ppm") {
+  TIMELINE_SCOPE("Ppm::SaveAs");
   std::ofstream file(filename);
   if (!file)
     throw std::runtime_error("ERROR: Could not write to file " + filename);
@@ -0,0 +1,18 @@
+#ifndef FRESNEL_HPP_
+#define FRESNEL_HPP_
+
+#include "fast_math.hpp"
+#include <cmath>
+
+// Schlick's approximation of Fresnel reflectance at the boundary from
+// index n1 to n2, for the cosine of the angle of incidence cos_i
+inline float Schlick(float n1, float n2, float cos_i, MathMode mode) {
+  float r0 = (n1 - n2) / (n1 + n2);
+  r0 *= r0;
+  float falloff = mode == MathMode::FAST
+                  ? FastMath::PowInt<5>(1.0f - cos_i)
+                  : std::pow(1.0f - cos_i, 5.0f);
+  return r0 + (1.0f - r0) * falloff;
+}
+
+#endif // FRESNEL_HPP_
@@ -0,0 +1,22 @@
+#ifndef GBUFFER_HPP_
+#define GBUFFER_HPP_
+
+#include "common.hpp"
+#include "objects.hpp"
+#include "vec.hpp"
+#include <limits> // numeric_limits
+
+// primary hit of a pixel - everything needed to shade it again when only
+// the lights or materials have changed
+struct GBufferSample {
+  bool hit{false};
+  float t{std::numeric_limits<float>::infinity()}; // hit distance
+  Vec3f hit_point{};
+  Vec3f normal{};
+  ObjectId id{no_object}; // hit object, also tells its material
+  Vec3u8 albedo{0, 0, 0}; // color of the hit material, guides denoising
+};
+
+using GBuffer = Mat<GBufferSample>;
+
+#endif // GBUFFER_HPP_
@@ -4,6 +4,11 @@
 #include "vec.hpp"
 #include "ray.hpp"
 #include <limits> // std::numeric_limits
+#include <cstdint>
+
+// objects are identified by their index in the scene
+using ObjectId = uint32_t;
+constexpr ObjectId no_object = std::numeric_limits<ObjectId>::max();
 
 // simple hit record in world coordinates between a ray and an object
 struct HitRecord {
@@ -31,6 +36,38 @@ struct Object {
   Material material;
 };
 
+// ray-sphere intersection, shared by Sphere and the compact sphere
+// records of the acceleration structures
+inline HitRecord IntersectSphere(const Vec3f& C, float r, const Ray& ray) {
+  HitRecord ret; // empty by default (no intersection)
+  // notation of ray-sphere intersection formula
+  auto L = ray.origin - C;
+  float a = ray.dir.Dot(ray.dir);
+  float b = 2 * ray.dir.Dot(L);
+  float c = L.Dot(L) - r * r;
+
+  float discriminant = b*b - 4*a*c;
+  ret.is_hit = discriminant > 0;
+  if (!ret.is_hit)
+    return ret;
+
+  float sqrt_disc = std::sqrt(discriminant);
+  float t1 = (-b - sqrt_disc) / (2 * a);
+  float t2 = (-b + sqrt_disc) / (2 * a);
+
+  // nearest positive intersection - at least one must be in front of
+  // the ray, otherwise the sphere is behind its origin
+  ret.is_hit = (t1 > 0) || (t2 > 0);
+  if (!ret.is_hit)
+    return ret;
+  float tmin = std::numeric_limits<float>::infinity();
+  ret.t = (t1 > 0 && t2 > 0) ? std::min(t1, t2) :
+          (t1 > 0 ? t1 :
+          (t2 > 0 ? t2 : tmin));
+  ret.where = ray.origin + ray.dir * ret.t;
+  return ret;
+}
+
 struct Sphere : Object {
   float radius;
   // assuming it's on the sphere
@@ -41,34 +78,7 @@ struct Sphere : Object {
     return (point - center).Dot(point - center) < radius * radius;
   }
   virtual HitRecord Intersects(const Ray& ray) const override {
-    HitRecord ret; // empty by default (no intersection)
-    // notation of ray-sphere intersection formula
-    auto C = center;
-    auto r = radius;
-    auto L = ray.origin - C;
-    float a = ray.dir.Dot(ray.dir);
-    float b = 2 * ray.dir.Dot(L);
-    float c = L.Dot(L) - r * r;
-
-    float discriminant = b*b - 4*a*c;
-    ret.is_hit = discriminant > 0;
-    if (!ret.is_hit)
-      return ret;
-
-    float sqrt_disc = std::sqrt(discriminant);
-    float t1 = (-b - sqrt_disc) / (2 * a);
-    float t2 = (-b + sqrt_disc) / (2 * a);
-
-    // nearest positive intersection - both must be in front of the ray
-    ret.is_hit |= (t1 > 0) || (t2 > 0);
-    if (!ret.is_hit)
-      return ret;
-    float tmin = std::numeric_limits<float>::infinity();
-    ret.t = (t1 > 0 && t2 > 0) ? std::min(t1, t2) :
-            (t1 > 0 ? t1 :
-            (t2 > 0 ? t2 : tmin));
-    ret.where = ray.origin + ray.dir * ret.t;
-    return ret;
+    return IntersectSphere(center, radius, ray);
   }
 };
 
@@ -0,0 +1,64 @@
+#ifndef RAY_BATCH_HPP_
+#define RAY_BATCH_HPP_
+
+#include "aabb.hpp"
+#include "ray.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+// how the reflected and refracted rays are traced
+enum class SecondaryOrder : int {
+  DEPTH_FIRST, // recursively, one pixel after the other
+  BATCHED,     // a generation of rays of many pixels at a time, as spawned
+  SORTED,      // BATCHED, grouped by direction and origin first
+};
+
+// where the time of the batched secondary rays went in the last frame
+struct SecondaryStats {
+  size_t rays{0};         // secondary rays traced in batches
+  double sort_s{0};       // computing the keys and sorting by them
+  double intersect_s{0};  // intersecting the batched rays
+};
+
+// spread the low 10 bits of x to every third bit
+inline uint32_t MortonExpand3(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+// sort key of a ray - its direction on an 8x8 octahedral map, then the
+// Morton code of its origin on a 1024^3 grid over `bounds`, so rays
+// heading the same way from nearby points end up next to each other
+inline uint64_t RayKey(const Ray& ray, const Aabb& bounds) {
+  // octahedral map of the unit direction to [0, 1]^2
+  const Vec3f& d = ray.dir;
+  float l1 = std::abs(d.x) + std::abs(d.y) + std::abs(d.z);
+  float u = d.x / l1, v = d.y / l1;
+  if (d.z < 0) {
+    float fu = (1.0f - std::abs(v)) * (u < 0 ? -1.0f : 1.0f);
+    float fv = (1.0f - std::abs(u)) * (v < 0 ? -1.0f : 1.0f);
+    u = fu;
+    v = fv;
+  }
+  auto quantize = [](float x, float lo, float hi, uint32_t levels) {
+    float cell = (x - lo) / (hi - lo) * levels;
+    return static_cast<uint32_t>(
+        std::clamp(cell, 0.0f, static_cast<float>(levels - 1)));
+  };
+  uint64_t dir = quantize(u, -1.0f, 1.0f, 8) << 3 | quantize(v, -1.0f, 1.0f, 8);
+  uint32_t cell[3];
+  for (int a = 0; a < 3; ++a) {
+    float lo = bounds.min.xyz[a], hi = bounds.max.xyz[a];
+    cell[a] = hi > lo ? quantize(ray.origin.xyz[a], lo, hi, 1024) : 0;
+  }
+  uint64_t origin = MortonExpand3(cell[0]) | MortonExpand3(cell[1]) << 1 |
+                    MortonExpand3(cell[2]) << 2;
+  return dir << 30 | origin;
+}
+
+#endif // RAY_BATCH_HPP_
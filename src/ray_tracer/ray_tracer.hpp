@@ -6,9 +6,27 @@
 #include "light.hpp"
 #include "camera.hpp"
 #include "ray.hpp"
+#include "gbuffer.hpp"
+#include "tiles.hpp"
+#include "render_cost.hpp"
+#include "timeline.hpp"
+#include "accelerator.hpp"
+#include "linear_accel.hpp"
+#include "aabb.hpp"
+#include "fast_math.hpp"
+#include "fresnel.hpp"
+#include "thread_pool.hpp"
+#include "ray_batch.hpp"
+#include "render_job.hpp"
+#include "tile_deps.hpp"
+#include "variable_rate.hpp"
 #include "common.hpp"
 #include <vector>
 #include <limits> // numeric_limits
+#include <stdexcept>
+#include <chrono>
+#include <memory>
+#include <atomic>
 
 
 struct TraceRecord {
@@ -17,7 +35,8 @@ struct TraceRecord {
   float t{std::numeric_limits<float>::infinity()}; // hit distance
   Vec3f hit_point{};       
   Vec3f normal{};             // surface normal at hit
-  const Sphere* obj{nullptr}; // hit object (nullptr if no hit)
+  Sphere obj{};               // copy of the hit object (valid if hit)
+  ObjectId id{no_object};     // index of the hit object in the scene
 };
 
 class RayTracer {
@@ -25,40 +44,637 @@ public:
   RayTracer(const Camera& camera, Lights& lights) :
     camera_(camera),
     image_(camera.width(), camera.height()),
-    lights_(lights) {}
+    lights_(lights),
+    linear_(objects_) {}
+  // linear_ refers to this tracer's own objects_, so a copy or move would
+  // keep tracing the source's
+  RayTracer(const RayTracer&) = delete;
+  RayTracer& operator=(const RayTracer&) = delete;
   // TODO: object
-  void AddObject(const Sphere& object) { objects_.push_back(object); }
+  void AddObject(const Sphere& object) {
+    objects_.push_back(object);
+    gbuffer_valid_ = false;
+    if (track_deps_)
+      edits_.push_back(SceneEdit{.id = static_cast<ObjectId>(objects_.size() - 1),
+                                 .after = BoundsOf(object)});
+  }
+  // replace an added object, e.g. to move it; not with an external
+  // accelerator set, which traces its own copy of the objects
+  void EditObject(ObjectId id, const Sphere& object) {
+    if (accel_)
+      throw std::runtime_error(
+          "ERROR: Can't edit objects traced through an accelerator");
+    Sphere& old = objects_.at(id);
+    SceneEdit edit{.id = id};
+    if (!(old.center == object.center) || old.radius != object.radius) {
+      edit.before = BoundsOf(old);
+      edit.after = BoundsOf(object);
+      gbuffer_valid_ = false;
+    }
+    old = object;
+    if (track_deps_)
+      edits_.push_back(edit);
+  }
+  // the added objects, e.g. to build a GridAccel over them
+  const std::vector<Sphere>& objects() const { return objects_; }
+  // trace against an external spatial index instead of the added
+  // objects, e.g. an OutOfCoreScene; nullptr goes back to the objects
+  void SetAccelerator(std::shared_ptr<const Accelerator> accel) {
+    accel_ = std::move(accel);
+    gbuffer_valid_ = false;
+    deps_valid_ = false;
+  }
   Image image() const { return image_; }
 
   void Trace(int max_reflections = 5) {
+    TIMELINE_SCOPE("RayTracer::Trace");
+    lights_.Normalize();
+    lights_.Prepare(scene());
+    auto plane = ImagePlaneOf(camera_);
+    int w = camera_.width();
+    int h = camera_.height();
+    // only hits are written - misses of the last frame mustn't linger
+    image_ = Image(w, h);
+    if (capture_gbuffer_)
+      gbuffer_ = GBuffer(w, h);
+    if (cost_map_enabled_)
+      cost_map_ = CostMap(w, h);
+    tile_bins_ = tile_binning_ && !accel_ ? BinObjects(camera_) : TileBins{};
+    if (variable_rate_.block > 1) {
+      TraceVariableRate(plane, max_reflections);
+    } else if (secondary_order_ != SecondaryOrder::DEPTH_FIRST) {
+      TraceBatched(plane, max_reflections);
+    } else if (track_deps_ && !accel_) {
+      const auto tiles = MakeTiles(w, h);
+      tile_deps_.assign(tiles.size(), {});
+      for (size_t t = 0; t < tiles.size(); ++t)
+        TraceTile(plane, tiles[t], tile_deps_[t], max_reflections);
+    } else {
+      ForEachPixel([&](int row, int col) {
+        TracePixel(plane, row, col, max_reflections);
+      });
+    }
+    gbuffer_valid_ = capture_gbuffer_;
+    gbuffer_plane_ = plane;
+    // dependencies are only recorded by depth-first tracing
+    deps_valid_ = track_deps_ && !accel_ && variable_rate_.block <= 1 &&
+                  secondary_order_ == SecondaryOrder::DEPTH_FIRST;
+    if (deps_valid_) {
+      deps_plane_ = plane;
+      deps_settings_ = SettingsOf(max_reflections);
+      deps_lights_.clear();
+      for (size_t i = 0; i < lights_.size(); ++i)
+        deps_lights_.push_back(lights_[i]);
+    }
+    edits_.clear();
+  }
+
+  // record per screen tile what the rays of the following Trace calls
+  // hit, so that TraceIncremental can re-trace only the tiles an edit can
+  // change; not with an external accelerator, a variable rate or batched
+  // secondary rays
+  void TrackDependencies(bool enable = true) {
+    track_deps_ = enable;
+    deps_valid_ = false;
+    edits_.clear();
+    tile_deps_.clear();
+  }
+
+  // re-trace the tiles that the objects added, edited with EditObject or
+  // whose material was accessed since the last frame can change - where
+  // their old or new bounds project to, hold points that they can shadow
+  // or secondary rays they can block, or that shaded them. A full Trace
+  // if there are no dependencies to go by, or the camera, the lights,
+  // max_reflections or a rendering setting have changed
+  void TraceIncremental(int max_reflections = 5) {
+    const int w = camera_.width(), h = camera_.height();
+    auto plane = ImagePlaneOf(camera_);
     lights_.Normalize();
+    bool geometry = false;
+    for (const auto& edit : edits_) geometry |= !edit.after.Empty();
+    bool same_lights = deps_lights_.size() == lights_.size();
+    for (size_t i = 0; i < lights_.size() && same_lights; ++i) {
+      const Light& a = lights_[i];
+      const Light& b = deps_lights_[i];
+      same_lights = a.type == b.type && a.data == b.data &&
+                    std::abs(a.intensity - b.intensity) < 1e-6f;
+    }
+    // the shadow maps cover the whole scene - any move can shift them
+    if (!deps_valid_ || !plane.SameAs(deps_plane_) || !same_lights ||
+        !SettingsOf(max_reflections).SameAs(deps_settings_) ||
+        static_cast<int>(image_.width) != w ||
+        static_cast<int>(image_.height) != h ||
+        (geometry && lights_.shadow_map_resolution() > 0)) {
+      incremental_stats_ = {.edits = edits_.size(), .full = true};
+      Trace(max_reflections);
+      incremental_stats_.tiles = incremental_stats_.retraced_tiles =
+          tile_deps_.size();
+      return;
+    }
+    TIMELINE_SCOPE("RayTracer::TraceIncremental");
+    lights_.Prepare(scene());
+    tile_bins_ = tile_binning_ && !accel_ ? BinObjects(camera_) : TileBins{};
+    const auto tiles = MakeTiles(w, h);
+    const auto dirty = DirtyTiles(tiles.size());
+    incremental_stats_ = {.edits = edits_.size(), .tiles = tiles.size()};
+    for (size_t t = 0; t < tiles.size(); ++t) {
+      if (!dirty[t]) continue;
+      ++incremental_stats_.retraced_tiles;
+      const Tile& tile = tiles[t];
+      // Trace only writes the pixels that hit something
+      for (int row = tile.row0; row < tile.row0 + tile.rows; ++row) {
+        for (int col = tile.col0; col < tile.col0 + tile.cols; ++col) {
+          image_.at(row, col) = Vec3u8{0, 0, 0};
+          if (cost_map_enabled_)
+            cost_map_.at(row, col) = 0;
+        }
+      }
+      tile_deps_[t] = {};
+      TraceTile(plane, tile, tile_deps_[t], max_reflections);
+    }
+    // the clean tiles' primary hits can't have changed
+    gbuffer_valid_ = capture_gbuffer_;
+    gbuffer_plane_ = plane;
+    edits_.clear();
+  }
+  const IncrementalStats& incremental_stats() const {
+    return incremental_stats_;
+  }
+
+  // render the scene from several cameras in one job on the pool. The
+  // objects, lights and accelerator are shared read-only and the tiles of
+  // all views are handed to the threads one at a time, so views that
+  // finish early don't leave cores idle. The G-buffer and cost map are
+  // left alone - they belong to the tracer's own camera
+  std::vector<Image> TraceViews(const std::vector<Camera>& cameras,
+                                ThreadPool& pool, int max_reflections = 5) {
+    TIMELINE_SCOPE("RayTracer::TraceViews");
+    lights_.Normalize();
+    lights_.Prepare(scene());
+    struct View {
+      ImagePlane plane{};
+      TileBins bins{};
+    };
+    const int nviews = static_cast<int>(cameras.size());
+    std::vector<View> views(nviews);
+    ParallelFor(pool, nviews, [&](int begin, int end) {
+      for (int v = begin; v < end; ++v) {
+        views[v].plane = ImagePlaneOf(cameras[v]);
+        if (tile_binning_ && !accel_)
+          views[v].bins = BinObjects(cameras[v]);
+      }
+    });
+    struct Job {
+      int view;
+      Tile tile;
+    };
+    std::vector<Image> images;
+    std::vector<Job> jobs;
+    for (int v = 0; v < nviews; ++v) {
+      images.emplace_back(cameras[v].width(), cameras[v].height());
+      for (const auto& tile : MakeTiles(cameras[v].width(), cameras[v].height()))
+        jobs.push_back(Job{.view = v, .tile = tile});
+    }
+    Latch done(1);
+    SubmitTileJobs(pool, jobs.size(), [&](size_t j) {
+      const auto& job = jobs[j];
+      const auto& view = views[job.view];
+      TIMELINE_SCOPE_ARG("tile", "view", job.view);
+      ForEachPixelMorton(job.tile, [&](int row, int col) {
+        Ray ray = PrimaryRay(view.plane, row, col);
+        auto result = IntersectPrimary(view.bins, ray, row, col);
+        if (!result.hit)
+          return;
+        images[job.view].at(row, col) =
+            Shade(cameras[job.view], ray, result, max_reflections).color;
+      });
+      return true;
+    }, [&] { done.CountDown(); });
+    done.Wait();
+    return images;
+  }
+
+  // start rendering the camera's current view on the pool and return at
+  // once. Progress is published tile by tile and Cancel() stops every
+  // thread after its current tile. The camera may move meanwhile, but
+  // the objects, lights and accelerator are shared read-only - Cancel()
+  // and Wait() a superseded render before editing them or tracing again.
+  // Like TraceViews, it leaves the tracer's image, G-buffer and cost map
+  // alone
+  RenderJob TraceAsync(ThreadPool& pool, int max_reflections = 5) {
+    TIMELINE_SCOPE("RayTracer::TraceAsync");
+    lights_.Normalize();
+    lights_.Prepare(scene());
+    struct Frame {
+      Camera camera;
+      ImagePlane plane{};
+      TileBins bins{};
+      std::vector<Tile> tiles;
+    };
+    auto frame = std::make_shared<Frame>(Frame{
+        .camera = camera_,
+        .plane = ImagePlaneOf(camera_),
+        .bins = tile_binning_ && !accel_ ? BinObjects(camera_) : TileBins{},
+        .tiles = MakeTiles(camera_.width(), camera_.height())});
+    auto state = std::make_shared<RenderJob::State>(
+        camera_.width(), camera_.height(), frame->tiles.size());
+    RenderJob ret(state);
+    SubmitTileJobs(pool, frame->tiles.size(),
+        [this, frame, state, max_reflections](size_t t) {
+          if (state->cancel.load(std::memory_order_relaxed))
+            return false;
+          TIMELINE_SCOPE("tile");
+          ForEachPixelMorton(frame->tiles[t], [&](int row, int col) {
+            Ray ray = PrimaryRay(frame->plane, row, col);
+            auto result = IntersectPrimary(frame->bins, ray, row, col);
+            if (!result.hit)
+              return;
+            state->image.at(row, col) =
+                Shade(frame->camera, ray, result, max_reflections).color;
+          });
+          state->tiles_done.fetch_add(1, std::memory_order_relaxed);
+          return true;
+        },
+        [state] {
+          state->status.set_value(
+              state->tiles_done.load() == state->tiles_total
+                  ? RenderStatus::FINISHED
+                  : RenderStatus::CANCELLED);
+        });
+    return ret;
+  }
+
+  // keep the primary hits of the following Trace calls so that Relight
+  // can re-shade the frame without re-tracing the camera rays
+  void CaptureGBuffer(bool enable = true) {
+    capture_gbuffer_ = enable;
+    if (!enable) {
+      gbuffer_ = GBuffer(0, 0);
+      gbuffer_valid_ = false;
+    }
+  }
+  const GBuffer& gbuffer() const { return gbuffer_; }
+  // materials of the added objects can be edited between Relight
+  // calls - geometry can't. Not with an external accelerator set, which
+  // shades its own copy of the objects
+  Material& material(ObjectId id) {
+    if (accel_)
+      throw std::runtime_error(
+          "ERROR: Can't edit materials traced through an accelerator");
+    if (track_deps_)
+      edits_.push_back(SceneEdit{.id = id});
+    return objects_.at(id).material;
+  }
+
+  // re-shade the frame after light or material edits, reusing the
+  // captured primary hits and only tracing shadow and secondary rays;
+  // falls back to a full Trace if the scene or camera have changed
+  void Relight(int max_reflections = 5) {
+    if (!capture_gbuffer_)
+      throw std::runtime_error("ERROR: Relight requires CaptureGBuffer()");
+    auto plane = ImagePlaneOf(camera_);
+    if (!gbuffer_valid_ || !plane.SameAs(gbuffer_plane_) ||
+        gbuffer_.width != image_.width || gbuffer_.height != image_.height) {
+      Trace(max_reflections);
+      return;
+    }
+    TIMELINE_SCOPE("RayTracer::Relight");
+    lights_.Normalize();
+    lights_.Prepare(scene());
+    if (cost_map_enabled_)
+      cost_map_ = CostMap(image_.width, image_.height);
+    ForEachPixel([&](int row, int col) {
+      const auto& sample = gbuffer_.at(row, col);
+      if (!sample.hit)
+        return;
+      PixelCostScope cost(*this, row, col);
+      TraceRecord primary;
+      primary.hit = true;
+      primary.t = sample.t;
+      primary.hit_point = sample.hit_point;
+      primary.normal = sample.normal;
+      primary.id = sample.id;
+      primary.obj = scene().At(sample.id);
+      Ray ray = PrimaryRay(plane, row, col);
+      image_.at(row, col) = Shade(camera_, ray, primary, max_reflections).color;
+    });
+  }
+
+  // record the cost of every pixel in the following Trace/Relight calls
+  // to find expensive regions, e.g. deep refraction chains
+  void EnableCostMap(CostMetric metric = CostMetric::TIME_NS) {
+    cost_map_enabled_ = true;
+    cost_metric_ = metric;
+  }
+  void DisableCostMap() { cost_map_enabled_ = false; }
+  const CostMap& cost_map() const { return cost_map_; }
+  // false-color visualization of the cost map
+  Image CostHeatmap() const { return Heatmap(cost_map_); }
+
+  // approximate pow/rsqrt in shading (see fast_math.hpp for the error
+  // bounds) - also switches the lights
+  void SetMathMode(MathMode mode) {
+    math_mode_ = mode;
+    lights_.SetMathMode(mode);
+  }
+
+  // primary rays only test the objects whose projection overlaps their
+  // tile (on by default); applies to the added objects, not to an
+  // external accelerator
+  void SetTileBinning(bool enable) { tile_binning_ = enable; }
+
+  // Morton-ordered tiles by default; COLUMNS is the legacy order
+  void SetPixelOrder(PixelOrder order) { pixel_order_ = order; }
+
+  // trace the reflected and refracted rays of Trace a generation at a
+  // time over batches of batch_tiles screen tiles, optionally sorted for
+  // coherence; the image is the same in every order
+  void SetSecondaryOrder(SecondaryOrder order, int batch_tiles = 64) {
+    if (batch_tiles < 1)
+      throw std::invalid_argument("SetSecondaryOrder: batch_tiles < 1");
+    secondary_order_ = order;
+    batch_tiles_ = batch_tiles;
+  }
+  // sort vs intersection time of the batched secondary rays of the
+  // last Trace - compare SORTED against BATCHED to see if sorting pays
+  const SecondaryStats& secondary_stats() const { return secondary_stats_; }
+
+  // trace the low-detail regions of the following Trace calls at a
+  // lower rate and reconstruct them (see variable_rate.hpp); secondary
+  // rays are then traced depth first
+  void SetVariableRate(const VariableRate& rate) {
+    if (rate.block != 0 && rate.block != 2 && rate.block != 4)
+      throw std::invalid_argument("SetVariableRate: block must be 0, 2 or 4");
+    variable_rate_ = rate;
+  }
+  const VariableRateStats& variable_rate_stats() const {
+    return variable_rate_stats_;
+  }
+
+private:
+  // objects overlapping each screen tile of a view, for primary rays;
+  // no bins means testing the whole scene
+  struct TileBins {
+    std::vector<std::vector<ObjectId>> bins;
+    int bins_x{0};
+  };
+
+  // world-space image plane the primary rays go through
+  struct ImagePlane {
+    Vec3f tl{};
+    Vec3f span_h{}; // horizontal (u) world span vector
+    Vec3f span_v{}; // vertical (v) world span vector
+    Vec3f eye{};
+    int width{0}, height{0}; // pixels sampled over the plane
+    bool SameAs(const ImagePlane& other) const {
+      return tl == other.tl && span_h == other.span_h &&
+             span_v == other.span_v && eye == other.eye;
+    }
+  };
+
+  static ImagePlane ImagePlaneOf(const Camera& camera) {
     // current camera plane corners (world-space)
-    auto corners = camera_.CornersWorld();
+    auto corners = camera.CornersWorld();
     // local camera axes in world space for rasterization
     Vec3f tl = corners[0];
     Vec3f tr = corners[1];
     Vec3f bl = corners[2];
-    // horizontal (u) and vertical (v) world span vectors
-    Vec3f span_h = tr - tl;
-    Vec3f span_v = bl - tl;
+    return ImagePlane{.tl = tl, .span_h = tr - tl, .span_v = bl - tl,
+                      .eye = camera.center(), .width = camera.width(),
+                      .height = camera.height()};
+  }
+
+  // adds the work done between its construction and destruction to
+  // the pixel's cost map entry
+  class PixelCostScope {
+  public:
+    PixelCostScope(RayTracer& tracer, int row, int col)
+        : tracer_(tracer), row_(row), col_(col) {
+      if (!tracer_.cost_map_enabled_) return;
+      start_ = ray_cost;
+      t_start_ = std::chrono::steady_clock::now();
+    }
+    ~PixelCostScope() {
+      if (!tracer_.cost_map_enabled_) return;
+      float cost = 0.0f;
+      switch (tracer_.cost_metric_) {
+        case CostMetric::TIME_NS:
+          cost = std::chrono::duration<float, std::nano>(
+                     std::chrono::steady_clock::now() - t_start_).count();
+          break;
+        case CostMetric::RAYS:
+          cost = (ray_cost.rays - start_.rays) +
+                 (ray_cost.shadow_rays - start_.shadow_rays);
+          break;
+        case CostMetric::INTERSECTIONS:
+          cost = ray_cost.intersections - start_.intersections;
+          break;
+      }
+      // batched rays come back to a pixel several times
+      tracer_.cost_map_.at(row_, col_) += cost;
+    }
+
+  private:
+    RayTracer& tracer_;
+    int row_, col_;
+    RayCost start_{};
+    std::chrono::steady_clock::time_point t_start_{};
+  };
+
+  // run run_job(j) for j in [0, njobs) on at most a task per thread of
+  // the pool, each pulling the next job index until none are left or
+  // run_job returns false; finish() runs once on the last task to stop.
+  // Returns at once
+  template <typename F, typename G>
+  static void SubmitTileJobs(ThreadPool& pool, size_t njobs, F run_job,
+                             G finish) {
+    if (njobs == 0) {
+      finish();
+      return;
+    }
+    struct Shared {
+      Shared(size_t njobs, int nworkers, F run_job, G finish)
+          : njobs(njobs), running(nworkers), run_job(std::move(run_job)),
+            finish(std::move(finish)) {}
+      const size_t njobs;
+      std::atomic<size_t> next{0};
+      std::atomic<int> running;
+      F run_job;
+      G finish;
+    };
+    const int nworkers = std::min<size_t>(pool.size(), njobs);
+    auto shared = std::make_shared<Shared>(njobs, nworkers, std::move(run_job),
+                                           std::move(finish));
+    for (int i = 0; i < nworkers; ++i) {
+      pool.Submit([shared] {
+        for (size_t j; (j = shared->next.fetch_add(1)) < shared->njobs;)
+          if (!shared->run_job(j)) break;
+        if (shared->running.fetch_sub(1) == 1)
+          shared->finish();
+      });
+    }
+  }
+
+  void TracePixel(const ImagePlane& plane, int row, int col,
+                  int max_reflections) {
+    PixelCostScope cost(*this, row, col);
+    Ray ray = PrimaryRay(plane, row, col);
+    auto result = IntersectPrimary(tile_bins_, ray, row, col);
+    if (capture_gbuffer_)
+      StoreGBuffer(row, col, result);
+    if (!result.hit)
+      return;
+    image_.at(row, col) = Shade(camera_, ray, result, max_reflections).color;
+  }
+
+  // trace a tile recording what its rays depend on into deps
+  void TraceTile(const ImagePlane& plane, const Tile& tile, TileDeps& deps,
+                 int max_reflections) {
+    TIMELINE_SCOPE("tile");
+    recording_ = &deps;
+    ForEachPixelMorton(tile, [&](int row, int col) {
+      TracePixel(plane, row, col, max_reflections);
+    });
+    recording_ = nullptr;
+    deps.Finish();
+  }
+
+  // tiles that an edit since the last frame can change
+  std::vector<bool> DirtyTiles(size_t ntiles) const {
+    std::vector<bool> ret(ntiles, false);
+    const int bins_x = (camera_.width() + tile_size - 1) / tile_size;
+    std::vector<Vec3f> points, directions;
+    for (size_t i = 0; i < lights_.size(); ++i) {
+      const Light& light = lights_[i];
+      if (light.type == LightType::POINT) points.push_back(*light.data);
+      if (light.type == LightType::DIRECTIONAL)
+        directions.push_back(light.data->Unit());
+    }
+    for (const auto& edit : edits_) {
+      for (size_t t = 0; t < ntiles; ++t)
+        ret[t] = ret[t] || tile_deps_[t].Uses(edit.id);
+      for (const Aabb* box : {&edit.before, &edit.after}) {
+        if (box->Empty()) continue;
+        // primary rays
+        auto range = TilesOverlapping(camera_, *box);
+        for (int by = range.by0; by <= range.by1; ++by)
+          for (int bx = range.bx0; bx <= range.bx1; ++bx)
+            ret[by * bins_x + bx] = true;
+        // secondary and shadow rays
+        for (size_t t = 0; t < ntiles; ++t) {
+          const TileDeps& deps = tile_deps_[t];
+          if (ret[t] || deps.unbounded || Overlap(deps.segments, *box)) {
+            ret[t] = true;
+            continue;
+          }
+          if (deps.points.Empty()) continue;
+          for (const auto& light : points) {
+            Aabb shadow_rays = deps.points;
+            shadow_rays.Expand(light);
+            ret[t] = ret[t] || Overlap(shadow_rays, *box);
+          }
+          for (const auto& dir : directions)
+            ret[t] = ret[t] || OverlapAlong(deps.points, *box, dir);
+        }
+      }
+    }
+    return ret;
+  }
+
+  // everything besides the camera, lights and objects that the pixels of
+  // a frame depend on
+  struct RenderSettings {
+    int max_reflections{0};
+    MathMode math_mode{MathMode::PRECISE};
+    MathMode light_math_mode{MathMode::PRECISE};
+    int shadow_map_resolution{0};
+    int pcf_radius{0};
+    const Accelerator* accel{nullptr};
+    bool tile_binning{false};
+    VariableRate variable_rate{};
+    SecondaryOrder secondary_order{SecondaryOrder::DEPTH_FIRST};
+    // sizes the G-buffer and cost map the tiles are traced into
+    bool capture_gbuffer{false};
+    bool cost_map{false};
+    CostMetric cost_metric{CostMetric::TIME_NS};
+    bool SameAs(const RenderSettings& o) const {
+      return max_reflections == o.max_reflections &&
+             math_mode == o.math_mode && light_math_mode == o.light_math_mode &&
+             shadow_map_resolution == o.shadow_map_resolution &&
+             pcf_radius == o.pcf_radius && accel == o.accel &&
+             tile_binning == o.tile_binning &&
+             variable_rate.block == o.variable_rate.block &&
+             variable_rate.pattern == o.variable_rate.pattern &&
+             variable_rate.max_color_diff == o.variable_rate.max_color_diff &&
+             secondary_order == o.secondary_order &&
+             capture_gbuffer == o.capture_gbuffer && cost_map == o.cost_map &&
+             cost_metric == o.cost_metric;
+    }
+  };
+  RenderSettings SettingsOf(int max_reflections) const {
+    return RenderSettings{.max_reflections = max_reflections,
+                          .math_mode = math_mode_,
+                          .light_math_mode = lights_.math_mode(),
+                          .shadow_map_resolution = lights_.shadow_map_resolution(),
+                          .pcf_radius = lights_.pcf_radius(),
+                          .accel = accel_.get(),
+                          .tile_binning = tile_binning_,
+                          .variable_rate = variable_rate_,
+                          .secondary_order = secondary_order_,
+                          .capture_gbuffer = capture_gbuffer_,
+                          .cost_map = cost_map_enabled_,
+                          .cost_metric = cost_metric_};
+  }
+
+  // tile rows and columns the projection of a box overlaps - all of
+  // them if it reaches behind the camera; empty if none
+  struct TileRange {
+    int bx0{0}, bx1{-1}, by0{0}, by1{-1};
+  };
+  static TileRange TilesOverlapping(const Camera& camera, const Aabb& box) {
+    const int w = camera.width(), h = camera.height();
+    Vec3i32 lo, hi;
+    int col0 = 0, col1 = w - 1, row0 = 0, row1 = h - 1;
+    if (camera.ProjectBox(box.min, box.max, lo, hi)) {
+      // camera plane to pixel coordinates, with slack for the
+      // truncation in Project and the (w - 1)/w pixel spacing
+      col0 = std::max(col0, lo.x + w / 2 - 3);
+      col1 = std::min(col1, hi.x + w / 2 + 3);
+      row0 = std::max(row0, lo.y + h / 2 - 3);
+      row1 = std::min(row1, hi.y + h / 2 + 3);
+    }
+    if (row0 > row1 || col0 > col1)
+      return {};
+    return {.bx0 = col0 / tile_size, .bx1 = col1 / tile_size,
+            .by0 = row0 / tile_size, .by1 = row1 / tile_size};
+  }
+
+  // call fn(row, col) for every pixel of the image in pixel_order_
+  template <typename F>
+  void ForEachPixel(F&& fn) const {
     int w = camera_.width();
     int h = camera_.height();
-    for (int col = 0; col < w; ++col) {
-      // normalized column coordinate
-      float u = static_cast<float>(col) / static_cast<float>(w - 1);
-      for (int row = 0; row < h; ++row) {
-        float v = static_cast<float>(row) / static_cast<float>(h - 1);
-        // bilinear point on the (possibly rotated) image plane
-        Vec3f point_world = tl + span_h * u + span_v * v;
-        Ray ray(camera_.center(), point_world);
-        auto result = TraceRay(ray, max_reflections);
-        if (result.hit)
-          image_.at(row, col) = result.color;
-      }
+    if (pixel_order_ == PixelOrder::COLUMNS) {
+      for (int col = 0; col < w; ++col)
+        for (int row = 0; row < h; ++row)
+          fn(row, col);
+      return;
+    }
+    for (const auto& tile : MakeTiles(w, h)) {
+      TIMELINE_SCOPE("tile");
+      ForEachPixelMorton(tile, fn);
     }
   }
 
-private:
+  Ray PrimaryRay(const ImagePlane& plane, int row, int col) const {
+    // normalized column and row coordinates
+    float u = static_cast<float>(col) / static_cast<float>(plane.width - 1);
+    float v = static_cast<float>(row) / static_cast<float>(plane.height - 1);
+    // bilinear point on the (possibly rotated) image plane
+    Vec3f point_world = plane.tl + plane.span_h * u + plane.span_v * v;
+    return Ray(plane.eye, point_world);
+  }
+
   // get the corrent IOR (index of refraction) and normal arrangement
   // for refraction calculations
   struct OrientationInfo {
@@ -72,16 +688,14 @@ private:
 
   // probe the refractive index of the surrounding medium slightly off the surface
   float SurroundingIOR(const Vec3f& where,
-                       const Sphere* self,
+                       ObjectId self,
                        const Vec3f& outward_normal) const {
     Vec3f probe = where + outward_normal * eps * 4.0f;
     float ret = 1.0f; // default is air
-    for (const auto& other : objects_) {
-      if (&other == self) continue;
-      if (other.IsInside(probe)) {
+    scene().ForEachContaining(probe, [&](ObjectId id, const Sphere& other) {
+      if (id != self)
         ret = other.material.refractive_index;
-      }
-    }
+    });
     return ret;
   }
 
@@ -90,76 +704,287 @@ private:
   // plane
   OrientationInfo ComputeOrientation(const Vec3f& N, const Vec3f& I,
                                      const Vec3f& hit_point,
-                                     const Sphere* obj,
+                                     const Sphere& obj,
+                                     ObjectId id,
                                      float ior_current) const {
     OrientationInfo ret;
     ret.entering = N.Dot(I) < 0.0f;
     ret.N_oriented = ret.entering ? N : -N;
-    float n_obj = obj->material.refractive_index;
-    ret.n1 = ret.entering ? SurroundingIOR(hit_point, obj, N) : ior_current;
-    ret.n2 = ret.entering ? n_obj : SurroundingIOR(hit_point, obj, -N);
+    float n_obj = obj.material.refractive_index;
+    ret.n1 = ret.entering ? SurroundingIOR(hit_point, id, N) : ior_current;
+    ret.n2 = ret.entering ? n_obj : SurroundingIOR(hit_point, id, -N);
     ret.eta = ret.n1 / ret.n2;
     ret.cos_i = -ret.N_oriented.Dot(I);
     return ret;
   }
 
-  // Schlick's approximation of Fresnel reflectance
+  Vec3f Unit(const Vec3f& v) const {
+    return math_mode_ == MathMode::FAST ? FastMath::Unit(v) : v.Unit();
+  }
+
+  // Fresnel reflectance (see fresnel.hpp) in the current math mode
   float Schlick(float n1, float n2, float cos_i) const {
-    float r0 = (n1 - n2) / (n1 + n2);
-    r0 *= r0;
-    return r0 + (1.0f - r0) * std::pow(1.0f - cos_i, 5.0f);
+    return ::Schlick(n1, n2, cos_i, math_mode_);
+  }
+
+  TraceRecord TraceRay(const Camera& camera, const Ray& ray, int depth, float ior_current = 1.0f, ObjectId self_reflect = no_object) {
+    TraceRecord ret = Intersect(ray);
+    if (recording_)
+      recording_->Secondary(ray.origin, ret.hit ? &ret.hit_point : nullptr);
+    if (!ret.hit)
+      return ret; // background color and no hit
+    return Shade(camera, ray, ret, depth, ior_current, self_reflect);
+  }
+
+  // nearest intersection of a ray with the scene; the color is left blank
+  TraceRecord Intersect(const Ray& ray) const {
+    TraceRecord ret;
+    ++ray_cost.rays;
+    auto nearest = scene().Closest(ray);
+    if (!nearest.is_hit)
+      return ret;
+    ret.t = nearest.hit.t;
+    ret.hit = true;
+    ret.hit_point = nearest.hit.where;
+    ret.obj = nearest.obj;
+    ret.id = nearest.id;
+    ret.normal = ret.obj.NormalAt(ret.hit_point);
+    return ret;
   }
 
-  TraceRecord TraceRay(const Ray& ray, int depth, float ior_current = 1.0f, const Sphere* self_reflect = nullptr) {
+  // Intersect for a camera ray, testing only the objects binned to the
+  // ray's screen tile - in id order, so the result is the same
+  TraceRecord IntersectPrimary(const TileBins& bins, const Ray& ray, int row,
+                               int col) const {
+    if (bins.bins.empty())
+      return Intersect(ray);
+    const auto& bin = bins.bins[(row / tile_size) * bins.bins_x + col / tile_size];
     TraceRecord ret;
-    // find nearest intersection
-    for (const auto& obj : objects_) {
-      auto hit = obj.Intersects(ray);
-      // reject hits that are behind the ray's origin
-      if (!hit.is_hit || hit.t <= 0) continue;
-    
-      if (hit.t < ret.t) {
-        ret.t = hit.t;
-        ret.hit = true;
-        ret.hit_point = hit.where;
-        ret.obj = &obj;
-        ret.normal = obj.NormalAt(hit.where);
+    ++ray_cost.rays;
+    // empty tiles go straight to the background
+    for (ObjectId id : bin) {
+      ++ray_cost.intersections;
+      auto hit = objects_[id].Intersects(ray);
+      if (!hit.is_hit || hit.t <= 0 || hit.t >= ret.t) continue;
+      ret.t = hit.t;
+      ret.hit = true;
+      ret.hit_point = hit.where;
+      ret.id = id;
+    }
+    if (ret.hit) {
+      ret.obj = objects_[ret.id];
+      ret.normal = ret.obj.NormalAt(ret.hit_point);
+    }
+    return ret;
+  }
+
+  // bin the objects to the screen tiles their projected bounds overlap;
+  // objects reaching behind the camera go to every tile
+  TileBins BinObjects(const Camera& camera) const {
+    TIMELINE_SCOPE("RayTracer::BinObjects");
+    const int w = camera.width(), h = camera.height();
+    TileBins ret;
+    ret.bins_x = (w + tile_size - 1) / tile_size;
+    const int bins_y = (h + tile_size - 1) / tile_size;
+    ret.bins.assign(ret.bins_x * bins_y, {});
+    for (ObjectId id = 0; id < objects_.size(); ++id) {
+      auto range = TilesOverlapping(camera, BoundsOf(objects_[id]));
+      for (int by = range.by0; by <= range.by1; ++by)
+        for (int bx = range.bx0; bx <= range.bx1; ++bx)
+          ret.bins[by * ret.bins_x + bx].push_back(id);
+    }
+    return ret;
+  }
+
+  // Trace at a variable rate - the block corners first, then a few
+  // probes inside every block, then the rest of it at full or low rate
+  // depending on them
+  void TraceVariableRate(const ImagePlane& plane, int max_reflections) {
+    const int w = plane.width, h = plane.height;
+    const int block = variable_rate_.block;
+    TIMELINE_SCOPE_ARG("RayTracer::TraceVariableRate", "block", block);
+    variable_rate_stats_ = {};
+    enum : uint8_t { PENDING, TRACED, HOLE, FILLED };
+    std::vector<uint8_t> state(static_cast<size_t>(w) * h, PENDING);
+    std::vector<Vec3u8> color(state.size());
+    std::vector<ObjectId> hit_id(state.size(), no_object);
+    auto trace = [&](int row, int col) {
+      size_t i = static_cast<size_t>(row) * w + col;
+      if (state[i] != PENDING) return;
+      PixelCostScope cost(*this, row, col);
+      Ray ray = PrimaryRay(plane, row, col);
+      auto result = IntersectPrimary(tile_bins_, ray, row, col);
+      if (capture_gbuffer_)
+        StoreGBuffer(row, col, result);
+      state[i] = TRACED;
+      ++variable_rate_stats_.traced_pixels;
+      if (!result.hit)
+        return;
+      hit_id[i] = result.id;
+      color[i] = Shade(camera_, ray, result, max_reflections).color;
+      image_.at(row, col) = color[i];
+    };
+    // reconstructed pixels still get their primary hit in the G-buffer
+    auto fill = [&](int row, int col, bool hit, const Vec3u8& c) {
+      state[static_cast<size_t>(row) * w + col] = FILLED;
+      ++variable_rate_stats_.reconstructed_pixels;
+      if (capture_gbuffer_)
+        StoreGBuffer(row, col, IntersectPrimary(tile_bins_,
+                                                PrimaryRay(plane, row, col),
+                                                row, col));
+      if (hit)
+        image_.at(row, col) = c;
+    };
+    // block corners: every block-th row/column and the last one
+    auto lattice = [block](int n) {
+      std::vector<int> ret;
+      for (int i = 0; i < n - 1; i += block) ret.push_back(i);
+      ret.push_back(n - 1);
+      return ret;
+    };
+    const auto rows = lattice(h), cols = lattice(w);
+    for (int row : rows)
+      for (int col : cols)
+        trace(row, col);
+
+    std::vector<std::pair<int, int>> holes; // checkerboard gaps
+    for (size_t by = 0; by + 1 < rows.size(); ++by) {
+      for (size_t bx = 0; bx + 1 < cols.size(); ++bx) {
+        const int r0 = rows[by], r1 = rows[by + 1];
+        const int c0 = cols[bx], c1 = cols[bx + 1];
+        // a highlight, shadow or edge can lie between the corners, so the
+        // center and (in 4x4 blocks, where they aren't the rest of the
+        // block) the edge midpoints are probed too
+        const int rc = (r0 + r1) / 2, cc = (c0 + c1) / 2;
+        const size_t probes[9] = {
+            static_cast<size_t>(r0) * w + c0, static_cast<size_t>(r0) * w + c1,
+            static_cast<size_t>(r1) * w + c0, static_cast<size_t>(r1) * w + c1,
+            static_cast<size_t>(rc) * w + cc,
+            static_cast<size_t>(r0) * w + cc, static_cast<size_t>(r1) * w + cc,
+            static_cast<size_t>(rc) * w + c0, static_cast<size_t>(rc) * w + c1};
+        const int nprobes = block > 2 ? 9 : 5;
+        for (int k = 4; k < nprobes; ++k)
+          trace(static_cast<int>(probes[k] / w),
+                static_cast<int>(probes[k] % w));
+        const ObjectId id = hit_id[probes[0]];
+        // reflections and refractions show other objects at full detail
+        bool low = id == no_object ||
+                   (scene().At(id).material.transparency < eps &&
+                    scene().At(id).material.reflective < eps);
+        for (int a = 0; a < nprobes && low; ++a) {
+          low = hit_id[probes[a]] == id;
+          for (int b = a + 1; b < nprobes && low; ++b)
+            low = MaxChannelDiff(color[probes[a]], color[probes[b]]) <=
+                  variable_rate_.max_color_diff;
+        }
+        ++variable_rate_stats_.blocks;
+        variable_rate_stats_.low_detail_blocks += low;
+        for (int row = r0; row <= r1; ++row) {
+          for (int col = c0; col <= c1; ++col) {
+            if (state[static_cast<size_t>(row) * w + col] != PENDING)
+              continue;
+            if (!low) {
+              trace(row, col);
+            } else if (variable_rate_.pattern == RatePattern::BLOCKS) {
+              float fx = static_cast<float>(col - c0) / (c1 - c0);
+              float fy = static_cast<float>(row - r0) / (r1 - r0);
+              fill(row, col, id != no_object,
+                   Bilinear(color[probes[0]], color[probes[1]],
+                            color[probes[2]], color[probes[3]], fx, fy));
+            } else if ((row + col) % 2 == 0) {
+              trace(row, col);
+            } else {
+              state[static_cast<size_t>(row) * w + col] = HOLE;
+              holes.emplace_back(row, col);
+            }
+          }
+        }
       }
     }
-    if (!ret.hit)
-      return ret; // background color and no hit
+    // the 4 neighbours of a checkerboard gap are all traced
+    for (auto [row, col] : holes) {
+      int sum[3] = {0, 0, 0}, nhits = 0, ntraced = 0;
+      const int dr[4] = {-1, 1, 0, 0}, dc[4] = {0, 0, -1, 1};
+      for (int k = 0; k < 4; ++k) {
+        int r = row + dr[k], c = col + dc[k];
+        if (r < 0 || r >= h || c < 0 || c >= w) continue;
+        size_t i = static_cast<size_t>(r) * w + c;
+        if (state[i] != TRACED) continue;
+        ++ntraced;
+        if (hit_id[i] == no_object) continue;
+        ++nhits;
+        for (int ch = 0; ch < 3; ++ch) sum[ch] += color[i].xyz[ch];
+      }
+      // mostly background around it - leave it as background
+      if (2 * nhits < ntraced || nhits == 0) {
+        fill(row, col, false, {});
+        continue;
+      }
+      fill(row, col, true,
+           Vec3u8{static_cast<uint8_t>((sum[0] + nhits / 2) / nhits),
+                  static_cast<uint8_t>((sum[1] + nhits / 2) / nhits),
+                  static_cast<uint8_t>((sum[2] + nhits / 2) / nhits)});
+    }
+    // images of a single row or column have no blocks
+    for (int row = 0; row < h; ++row)
+      for (int col = 0; col < w; ++col)
+        trace(row, col);
+  }
+
+  // the external accelerator if one is set, otherwise the added objects
+  const Accelerator& scene() const {
+    return accel_ ? *accel_ : static_cast<const Accelerator&>(linear_);
+  }
+
+  // what shading a hit takes from its child rays
+  struct Bounce {
+    Vec3u8 direct{};     // diffuse and specular light
+    bool leaf{true};     // no child rays - the color is `direct`
+    Ray refl_ray{{}, {}};
+    float n1{1.0f};      // IOR the reflected ray travels in
+    bool refract{false}; // whether there is a refracted ray
+    Ray refr_ray{{}, {}};
+    float n2{1.0f};      // IOR the refracted ray travels in
+    float refl_weight{0.0f};
+    float trans_weight{0.0f};
+  };
 
-    float trans = std::clamp(ret.obj->material.transparency, 0.0f, 1.0f);
+  // direct lighting of a hit found by Intersect and the reflected and
+  // refracted child rays it spawns
+  Bounce Spawn(const Camera& camera, const Ray& ray, const TraceRecord& hit, int depth, float ior_current = 1.0f, ObjectId self_reflect = no_object) const {
+    Bounce ret;
+    float trans = std::clamp(hit.obj.material.transparency, 0.0f, 1.0f);
     // Direct lighting (surface shading) due diffusion/specular, based
     // on the object's color. Highly transparent objects (>0.5)
     // suppress it so they don't paint themselves.
-    Vec3u8 direct = (trans > 0.5f)
-                  ? Vec3u8{0,0,0}
-                  : lights_.ColorAt(objects_, *ret.obj, ret.hit_point, camera_);
+    ret.direct = (trans > 0.5f)
+               ? Vec3u8{0,0,0}
+               : lights_.ColorAt(scene(), hit.obj, hit.id,
+                                 hit.hit_point, camera);
 
-    float refl = std::clamp(ret.obj->material.reflective, 0.0f, 1.0f);
+    float refl = std::clamp(hit.obj.material.reflective, 0.0f, 1.0f);
     // if this hit is the immediate back-face of the object we just entered
     // via refraction, suppress reflection once to avoid the double glint effect 
-    if (self_reflect && ret.obj == self_reflect) {
+    if (hit.id == self_reflect) {
       refl = 0.0f;
       std::cout << "---\n";
     }
 
     // final ray bounce or nothing to reflect/refract
-    if (depth <= 1 || (refl < eps && trans < eps)) {
-      ret.color = direct;
+    if (depth <= 1 || (refl < eps && trans < eps))
       return ret;
-    }
+    ret.leaf = false;
 
     //----------------------------------------------------------------
     // Orient the normal and determine n1, n2 for refraction
     //----------------------------------------------------------------
-    Vec3f N = ret.normal;
+    Vec3f N = hit.normal;
     // incident (pointing away from origin toward surface)
     Vec3f I = ray.dir; 
 
     // Determine oriented normal and IORs for refraction
-    auto ori = ComputeOrientation(N, I, ret.hit_point, ret.obj, ior_current);
+    auto ori = ComputeOrientation(N, I, hit.hit_point, hit.obj, hit.id,
+                                  ior_current);
     Vec3f N_oriented = ori.N_oriented;
     float n1 = ori.n1, n2 = ori.n2, eta = ori.eta, cos_i = ori.cos_i;
    
@@ -175,65 +1000,78 @@ private:
                       -N_oriented;
 
     // slightly push reflection off the surface to avoid self-intersection
-    ray_refl.origin = ret.hit_point + hemi_refl * eps * 4.0f;
+    ray_refl.origin = hit.hit_point + hemi_refl * eps * 4.0f;
 #else
     Vec3f N_reflect = N_oriented; // already facing opposite incident I
-    Vec3f refl_dir = (I - N_reflect * (2.0f * I.Dot(N_reflect))).Unit();
-    Ray ray_refl(ret.hit_point + N_reflect * eps * 4.0f,
-                 ret.hit_point + (N_reflect + refl_dir) * eps * 4.0f);
+    Vec3f refl_dir = Unit(I - N_reflect * (2.0f * I.Dot(N_reflect)));
+    Ray ray_refl(hit.hit_point + N_reflect * eps * 4.0f,
+                 hit.hit_point + (N_reflect + refl_dir) * eps * 4.0f);
     ray_refl.dir = refl_dir;
 #endif
     // -----> child ray (1): reflect for this medium
-    Vec3u8 refl_col = TraceRay(ray_refl, depth - 1, n1).color;
+    ret.refl_ray = ray_refl;
+    ret.n1 = n1;
 
     // k := 1 - eta^2 * (1 - cos_i^2) < 0 => total internal reflection
     float k = 1.0f - eta * eta * (1.0f - cos_i * cos_i);
-    float trans_weight = trans * (1.0f - R_fresnel);
-    float refl_weight = refl + R_fresnel * trans;
+    ret.trans_weight = trans * (1.0f - R_fresnel);
+    ret.refl_weight = refl + R_fresnel * trans;
 
     bool tir = k < 0.0f;
     //----------------------------------------------------------------
     // refract child ray or do TIR
     //----------------------------------------------------------------
-    Vec3u8 refr_color{0, 0, 0};
     if (!tir && trans > eps) {
       float cos_t = std::sqrt(std::max(0.0f, k));
       // vectorized Snell's law for refraction
       Ray refr_ray({}, {});
-      refr_ray.dir = (I * eta +
-                      N_oriented * (eta * cos_i - cos_t)).Unit();
-      refr_ray.origin = ret.hit_point + refr_ray.dir * eps * 4.0f;
-      // suppress reflection on the immediate back-face of the same object
+      refr_ray.dir = Unit(I * eta + N_oriented * (eta * cos_i - cos_t));
+      refr_ray.origin = hit.hit_point + refr_ray.dir * eps * 4.0f;
       // -----> child ray (2): refract in the next medium
-      refr_color = TraceRay(refr_ray, depth - 1, n2, ret.obj).color;
-      //refr_color = {255, 0 ,0};
-      //refr_color = TraceRay(refr_ray, depth - 1, n2).color;
+      ret.refract = true;
+      ret.refr_ray = refr_ray;
+      ret.n2 = n2;
+    } else if (tir) {
+      // all energy goes to reflection if TIR
+      ret.trans_weight = 0.0f;
+      ret.refl_weight = std::min(1.0f, ret.refl_weight + trans);
+    }
+    return ret;
+  }
+
+  // blend the direct light of a hit with the colors its child rays
+  // brought back
+  Vec3u8 Blend(const Bounce& bounce, const Sphere& obj, Vec3u8 refl_col,
+               Vec3u8 refr_col) const {
+    if (bounce.leaf)
+      return bounce.direct;
+    Vec3u8 refr_color{0, 0, 0};
+    if (bounce.refract) {
       // tint heuristic (weight) to paint transparent objects
-      float tint_w = ret.obj->material.tint * trans;
+      float trans = std::clamp(obj.material.transparency, 0.0f, 1.0f);
+      float tint_w = obj.material.tint * trans;
       auto ApplyTint = [&](uint8_t col_next, uint8_t color_curr)->uint8_t{
         float curr_norm = static_cast<float>(color_curr) / 255.0f;
         float w = (1.0f - tint_w) + tint_w * curr_norm;
         return static_cast<uint8_t>(std::min(255.0f, col_next * w));
       };
-      auto color_current = ret.obj->material.color;
+      auto color_current = obj.material.color;
       refr_color = Vec3u8{
-        ApplyTint(refr_color.x, color_current.x),
-        ApplyTint(refr_color.y, color_current.y),
-        ApplyTint(refr_color.z, color_current.z)
+        ApplyTint(refr_col.x, color_current.x),
+        ApplyTint(refr_col.y, color_current.y),
+        ApplyTint(refr_col.z, color_current.z)
       };
-    } else if (tir) {
-      // all energy goes to reflection if TIR
-      trans_weight = 0.0f;
-      refl_weight = std::min(1.0f, refl_weight + trans);
     }
 
     //----------------------------------------------------------------
     // blend direct, reflected and refracted colors
     //----------------------------------------------------------------
+    float refl_weight = bounce.refl_weight, trans_weight = bounce.trans_weight;
     float total = refl_weight + trans_weight;
     // direct component gets the leftover energy
     float w_direct = 1.0f - std::min(total, 1.0f);
-    ret.color = Vec3u8{
+    const Vec3u8& direct = bounce.direct;
+    return Vec3u8{
       static_cast<uint8_t>(direct.x * w_direct +
                            refl_col.x * refl_weight +
                            refr_color.x * trans_weight),
@@ -244,14 +1082,181 @@ private:
                            refl_col.z * refl_weight +
                            refr_color.z * trans_weight)
     };
+  }
+
+  // color of a hit found by Intersect - direct lighting plus the
+  // reflected and refracted child rays, traced depth first
+  TraceRecord Shade(const Camera& camera, const Ray& ray, TraceRecord ret, int depth, float ior_current = 1.0f, ObjectId self_reflect = no_object) {
+    if (recording_)
+      recording_->Shaded(ret.id, ret.hit_point);
+    Bounce bounce = Spawn(camera, ray, ret, depth, ior_current, self_reflect);
+    Vec3u8 refl_col{0, 0, 0}, refr_col{0, 0, 0};
+    if (!bounce.leaf)
+      refl_col = TraceRay(camera, bounce.refl_ray, depth - 1, bounce.n1).color;
+    // suppress reflection on the immediate back-face of the same object
+    if (bounce.refract)
+      refr_col = TraceRay(camera, bounce.refr_ray, depth - 1, bounce.n2,
+                          ret.id).color;
+    ret.color = Blend(bounce, ret.obj, refl_col, refr_col);
     return ret;
   }
 
+  void StoreGBuffer(int row, int col, const TraceRecord& primary) {
+    gbuffer_.at(row, col) = GBufferSample{
+        .hit = primary.hit,
+        .t = primary.t,
+        .hit_point = primary.hit_point,
+        .normal = primary.normal,
+        .id = primary.id,
+        .albedo = primary.hit ? primary.obj.material.color : Vec3u8{}};
+  }
+
+  // one ray of the shading tree of a pixel in TraceBatched
+  struct RayNode {
+    Ray ray{{}, {}};
+    int depth{0};
+    float ior{1.0f};
+    ObjectId self_reflect{no_object};
+    int row{0}, col{0};
+    TraceRecord rec{};
+    Bounce bounce{};
+    int refl{-1}, refr{-1}; // child nodes
+  };
+
+  // Trace with the child rays of all pixels of a batch of tiles traced
+  // a generation at a time rather than depth first. The shading trees
+  // are kept and blended bottom up afterwards with the same arithmetic
+  // as Shade, so the image doesn't change.
+  void TraceBatched(const ImagePlane& plane, int max_reflections) {
+    using Clock = std::chrono::steady_clock;
+    secondary_stats_ = {};
+    const auto tiles = MakeTiles(plane.width, plane.height);
+    std::vector<RayNode> nodes;
+    std::vector<std::pair<uint64_t, int>> order;
+    for (size_t first = 0; first < tiles.size(); first += batch_tiles_) {
+      size_t last = std::min(tiles.size(), first + batch_tiles_);
+      TIMELINE_SCOPE_ARG("tile batch", "first", first);
+      nodes.clear();
+      for (size_t t = first; t < last; ++t) {
+        ForEachPixelMorton(tiles[t], [&](int row, int col) {
+          PixelCostScope cost(*this, row, col);
+          RayNode node;
+          node.ray = PrimaryRay(plane, row, col);
+          node.depth = max_reflections;
+          node.row = row;
+          node.col = col;
+          node.rec = IntersectPrimary(tile_bins_, node.ray, row, col);
+          if (capture_gbuffer_)
+            StoreGBuffer(row, col, node.rec);
+          nodes.push_back(node);
+        });
+      }
+      const size_t nprimary = nodes.size();
+      for (size_t gen_begin = 0; gen_begin < nodes.size();) {
+        const size_t gen_end = nodes.size();
+        // shade the generation and spawn the next one
+        for (size_t i = gen_begin; i < gen_end; ++i) {
+          if (!nodes[i].rec.hit) continue;
+          PixelCostScope cost(*this, nodes[i].row, nodes[i].col);
+          nodes[i].bounce = Spawn(camera_, nodes[i].ray, nodes[i].rec,
+                                  nodes[i].depth, nodes[i].ior,
+                                  nodes[i].self_reflect);
+          // copied - the pushes below move the nodes
+          const Bounce bounce = nodes[i].bounce;
+          if (bounce.leaf) continue;
+          RayNode child;
+          child.depth = nodes[i].depth - 1;
+          child.row = nodes[i].row;
+          child.col = nodes[i].col;
+          child.ray = bounce.refl_ray;
+          child.ior = bounce.n1;
+          nodes[i].refl = static_cast<int>(nodes.size());
+          nodes.push_back(child);
+          if (bounce.refract) {
+            // suppress reflection on the immediate back-face of the same object
+            child.ray = bounce.refr_ray;
+            child.ior = bounce.n2;
+            child.self_reflect = nodes[i].rec.id;
+            nodes[i].refr = static_cast<int>(nodes.size());
+            nodes.push_back(child);
+          }
+        }
+        // intersect the next generation
+        order.clear();
+        for (size_t i = gen_end; i < nodes.size(); ++i)
+          order.emplace_back(0, static_cast<int>(i));
+        if (secondary_order_ == SecondaryOrder::SORTED && !order.empty()) {
+          auto start = Clock::now();
+          Aabb origins;
+          for (const auto& entry : order)
+            origins.Expand(nodes[entry.second].ray.origin);
+          for (auto& entry : order)
+            entry.first = RayKey(nodes[entry.second].ray, origins);
+          std::sort(order.begin(), order.end());
+          secondary_stats_.sort_s +=
+              std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        auto start = Clock::now();
+        for (const auto& entry : order) {
+          RayNode& node = nodes[entry.second];
+          PixelCostScope cost(*this, node.row, node.col);
+          node.rec = Intersect(node.ray);
+        }
+        secondary_stats_.intersect_s +=
+            std::chrono::duration<double>(Clock::now() - start).count();
+        secondary_stats_.rays += order.size();
+        gen_begin = gen_end;
+      }
+      // children come after their parents
+      for (size_t i = nodes.size(); i-- > 0;) {
+        RayNode& node = nodes[i];
+        if (!node.rec.hit) continue; // background
+        Vec3u8 refl_col = node.refl >= 0 ? nodes[node.refl].rec.color : Vec3u8{0, 0, 0};
+        Vec3u8 refr_col = node.refr >= 0 ? nodes[node.refr].rec.color : Vec3u8{0, 0, 0};
+        node.rec.color = Blend(node.bounce, node.rec.obj, refl_col, refr_col);
+      }
+      for (size_t i = 0; i < nprimary; ++i)
+        if (nodes[i].rec.hit)
+          image_.at(nodes[i].row, nodes[i].col) = nodes[i].rec.color;
+    }
+  }
+
   const Camera &camera_;
   std::vector<Sphere> objects_;
   // image buffer to store the final colors
   Image image_;
   Lights& lights_;
+  LinearAccel linear_;
+  std::shared_ptr<const Accelerator> accel_;
+  PixelOrder pixel_order_{PixelOrder::MORTON_TILES};
+  SecondaryOrder secondary_order_{SecondaryOrder::DEPTH_FIRST};
+  size_t batch_tiles_{64};
+  SecondaryStats secondary_stats_{};
+  VariableRate variable_rate_{};
+  VariableRateStats variable_rate_stats_{};
+  MathMode math_mode_{MathMode::PRECISE};
+  // objects overlapping each screen tile, for primary rays
+  bool tile_binning_{true};
+  TileBins tile_bins_{};
+  // primary hits kept for relighting
+  bool capture_gbuffer_{false};
+  bool gbuffer_valid_{false};
+  GBuffer gbuffer_{0, 0};
+  ImagePlane gbuffer_plane_{};
+  // per-pixel cost diagnostics
+  bool cost_map_enabled_{false};
+  CostMetric cost_metric_{CostMetric::TIME_NS};
+  CostMap cost_map_{0, 0};
+  // what each tile depended on, for TraceIncremental
+  bool track_deps_{false};
+  bool deps_valid_{false};
+  std::vector<TileDeps> tile_deps_;
+  ImagePlane deps_plane_{};
+  std::vector<Light> deps_lights_;
+  RenderSettings deps_settings_{};
+  std::vector<SceneEdit> edits_; // since the last frame
+  TileDeps* recording_{nullptr}; // of the tile being traced
+  IncrementalStats incremental_stats_{};
 };
 
 #endif // RAY_TRACER_HPP_
@@ -0,0 +1,70 @@
+#ifndef RENDER_JOB_HPP_
+#define RENDER_JOB_HPP_
+
+#include "common.hpp"
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+
+// how an asynchronous render ended, or that it hasn't yet
+enum class RenderStatus : int {
+  RUNNING,
+  FINISHED,
+  CANCELLED,
+};
+
+// handle of a frame rendered on a thread pool (see RayTracer::TraceAsync);
+// copies refer to the same render
+class RenderJob {
+public:
+  // shared by the handles and the tasks rendering the frame
+  struct State {
+    State(int w, int h, size_t ntiles) : image(w, h), tiles_total(ntiles) {}
+    Image image;
+    const size_t tiles_total;
+    std::atomic<size_t> tiles_done{0};
+    std::atomic<bool> cancel{false};
+    // set by the last task to stop
+    std::promise<RenderStatus> status;
+  };
+
+  explicit RenderJob(std::shared_ptr<State> state)
+      : state_(std::move(state)),
+        status_(state_->status.get_future().share()) {}
+
+  // the tasks check it before each tile, so every thread stops after
+  // the tile it is on
+  void Cancel() { state_->cancel.store(true, std::memory_order_relaxed); }
+
+  // progress - safe to poll from any thread while the render runs
+  size_t tiles_done() const {
+    return state_->tiles_done.load(std::memory_order_relaxed);
+  }
+  size_t tiles_total() const { return state_->tiles_total; }
+  float progress() const {
+    return tiles_total() ? static_cast<float>(tiles_done()) / tiles_total()
+                         : 1.0f;
+  }
+  RenderStatus status() const {
+    return status_.wait_for(std::chrono::seconds(0)) ==
+                   std::future_status::ready
+               ? status_.get()
+               : RenderStatus::RUNNING;
+  }
+
+  // block until the render has finished or stopped after Cancel
+  RenderStatus Wait() const { return status_.get(); }
+  // the frame, once done; tiles a cancelled render didn't get to are
+  // left black
+  const Image& image() const {
+    Wait();
+    return state_->image;
+  }
+
+private:
+  std::shared_ptr<State> state_;
+  std::shared_future<RenderStatus> status_;
+};
+
+#endif // RENDER_JOB_HPP_
@@ -0,0 +1,93 @@
+#ifndef TILE_DEPS_HPP_
+#define TILE_DEPS_HPP_
+
+#include "aabb.hpp"
+#include "objects.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+// what the rays of a screen tile depended on in the last frame, to tell
+// whether an edit to the scene can change the tile's pixels
+struct TileDeps {
+  std::vector<ObjectId> objects; // shaded by a ray of the tile, sorted
+  Aabb points;           // shaded surface points - where shadow rays start
+  Aabb segments;         // secondary rays from their origin to their hit
+  bool unbounded{false}; // a secondary ray left the scene
+
+  void Shaded(ObjectId id, const Vec3f& at) {
+    objects.push_back(id);
+    points.Expand(at);
+  }
+  void Secondary(const Vec3f& from, const Vec3f* to) {
+    if (!to) {
+      unbounded = true;
+      return;
+    }
+    segments.Expand(from);
+    segments.Expand(*to);
+  }
+  // once the tile has been traced
+  void Finish() {
+    std::sort(objects.begin(), objects.end());
+    objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+    objects.shrink_to_fit();
+  }
+  bool Uses(ObjectId id) const {
+    return std::binary_search(objects.begin(), objects.end(), id);
+  }
+};
+
+// an object added or changed since the last frame; before/after are
+// empty if its geometry didn't change (a material edit) and before is
+// empty for a new object
+struct SceneEdit {
+  ObjectId id{no_object};
+  Aabb before{};
+  Aabb after{};
+};
+
+// how much of the last TraceIncremental was re-traced
+struct IncrementalStats {
+  size_t edits{0};
+  size_t tiles{0};
+  size_t retraced_tiles{0};
+  bool full{false}; // fell back to a full Trace
+};
+
+inline bool Overlap(const Aabb& a, const Aabb& b) {
+  for (int i = 0; i < 3; ++i)
+    if (a.min.xyz[i] > b.max.xyz[i] || b.min.xyz[i] > a.max.xyz[i])
+      return false;
+  return true;
+}
+
+// whether a box can be on a shadow ray from `points` along either way of
+// the unit direction `dir` - both boxes are projected on the plane normal
+// to it, where the rays are points, and their footprints tested for
+// overlap
+inline bool OverlapAlong(const Aabb& points, const Aabb& box,
+                         const Vec3f& dir) {
+  Vec3f helper = std::abs(dir.x) < 0.9f ? Vec3f{1, 0, 0} : Vec3f{0, 1, 0};
+  Vec3f u = helper.Cross(dir).Unit();
+  // two axes only - conservative, the footprints are hexagons
+  for (const auto& axis : {u, dir.Cross(u)}) {
+    // extent of a box along an axis from its center and half size
+    auto extent = [&axis](const Aabb& b, float& lo, float& hi) {
+      Vec3f center = (b.min + b.max) * 0.5f, half = (b.max - b.min) * 0.5f;
+      float c = center.Dot(axis);
+      float r = std::abs(half.x * axis.x) + std::abs(half.y * axis.y) +
+                std::abs(half.z * axis.z);
+      lo = c - r;
+      hi = c + r;
+    };
+    float lo0, hi0, lo1, hi1;
+    extent(points, lo0, hi0);
+    extent(box, lo1, hi1);
+    if (lo0 > hi1 || lo1 > hi0) return false;
+  }
+  return true;
+}
+
+#endif // TILE_DEPS_HPP_
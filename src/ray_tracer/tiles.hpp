@@ -0,0 +1,63 @@
+#ifndef TILES_HPP_
+#define TILES_HPP_
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+// order in which the pixels of the image are traced
+enum class PixelOrder : int {
+  COLUMNS,      // column by column, top to bottom
+  MORTON_TILES, // square tiles in row-major order, Z-order inside each tile
+};
+
+// rectangular block of pixels - the ones at the image edges may be cut
+struct Tile {
+  int row0{0};
+  int col0{0};
+  int rows{0};
+  int cols{0};
+};
+
+// edge of a tile in pixels; must be a power of 2 for the Morton order
+constexpr int tile_size = 16;
+
+// split a w x h image into tile_size x tile_size tiles, row-major
+inline std::vector<Tile> MakeTiles(int w, int h) {
+  std::vector<Tile> ret;
+  for (int row0 = 0; row0 < h; row0 += tile_size) {
+    for (int col0 = 0; col0 < w; col0 += tile_size) {
+      ret.push_back(Tile{.row0 = row0,
+                         .col0 = col0,
+                         .rows = std::min(tile_size, h - row0),
+                         .cols = std::min(tile_size, w - col0)});
+    }
+  }
+  return ret;
+}
+
+// gather the even (x) or odd (y) bits of a Morton code
+inline uint32_t MortonCompact(uint32_t code) {
+  code &= 0x55555555;
+  code = (code | (code >> 1)) & 0x33333333;
+  code = (code | (code >> 2)) & 0x0f0f0f0f;
+  code = (code | (code >> 4)) & 0x00ff00ff;
+  code = (code | (code >> 8)) & 0x0000ffff;
+  return code;
+}
+
+// visit the pixels of a tile in Z-order so that consecutive rays stay
+// close both on the image and in the scene
+template <typename F>
+void ForEachPixelMorton(const Tile& tile, F&& fn) {
+  for (uint32_t code = 0; code < tile_size * tile_size; ++code) {
+    int col = static_cast<int>(MortonCompact(code));
+    int row = static_cast<int>(MortonCompact(code >> 1));
+    // cut tiles at the image edges
+    if (row >= tile.rows || col >= tile.cols)
+      continue;
+    fn(tile.row0 + row, tile.col0 + col);
+  }
+}
+
+#endif // TILES_HPP_
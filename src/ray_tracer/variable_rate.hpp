@@ -0,0 +1,52 @@
+#ifndef VARIABLE_RATE_HPP_
+#define VARIABLE_RATE_HPP_
+
+#include "vec.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+
+// how the pixels of a low-detail block are filled in
+enum class RatePattern : int {
+  CHECKERBOARD, // trace every other pixel, average the rest from neighbours
+  BLOCKS,       // trace only the block corners, interpolate the rest
+};
+
+// Variable-rate shading: the image is split into block x block squares
+// whose corners, center and - in 4x4 blocks - edge midpoints are traced
+// first. A block is low-detail if these probes hit the same opaque,
+// non-reflective object (or all miss) with colors at most max_color_diff
+// apart, i.e. it has no edge, highlight, shadow edge, reflection or
+// refraction at them - only those blocks are traced at a lower rate.
+struct VariableRate {
+  int block{0}; // 2 or 4; 0 traces every pixel
+  RatePattern pattern{RatePattern::CHECKERBOARD};
+  int max_color_diff{8}; // per channel, 0-255
+};
+
+// how much of the last frame was traced rather than reconstructed
+struct VariableRateStats {
+  size_t blocks{0};
+  size_t low_detail_blocks{0};
+  size_t traced_pixels{0};
+  size_t reconstructed_pixels{0};
+};
+
+inline int MaxChannelDiff(const Vec3u8& a, const Vec3u8& b) {
+  return std::max({std::abs(a.x - b.x), std::abs(a.y - b.y),
+                   std::abs(a.z - b.z)});
+}
+
+// bilinear interpolation between the corners of a block, fx and fy in
+// [0, 1] from the top left corner
+inline Vec3u8 Bilinear(const Vec3u8& tl, const Vec3u8& tr, const Vec3u8& bl,
+                       const Vec3u8& br, float fx, float fy) {
+  auto lerp = [&](int i) {
+    float top = tl.xyz[i] + (tr.xyz[i] - tl.xyz[i]) * fx;
+    float bottom = bl.xyz[i] + (br.xyz[i] - bl.xyz[i]) * fx;
+    return static_cast<uint8_t>(top + (bottom - top) * fy + 0.5f);
+  };
+  return Vec3u8{lerp(0), lerp(1), lerp(2)};
+}
+
+#endif // VARIABLE_RATE_HPP_
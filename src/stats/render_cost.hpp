@@ -0,0 +1,55 @@
+#ifndef RENDER_COST_HPP_
+#define RENDER_COST_HPP_
+
+#include "common.hpp"
+#include "vec.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// work done by the tracer - each thread counts its own
+struct RayCost {
+  uint64_t rays{0};          // primary and secondary rays
+  uint64_t shadow_rays{0};
+  uint64_t intersections{0}; // ray-object intersection tests
+};
+
+inline thread_local RayCost ray_cost;
+
+// what a cost map measures per pixel
+enum class CostMetric : int {
+  TIME_NS,       // wall time spent on the pixel
+  RAYS,          // primary, secondary and shadow rays
+  INTERSECTIONS, // ray-object tests
+};
+
+using CostMap = Mat<float>;
+
+// false-color image of a cost map, from black (cheap) through blue, cyan,
+// green and yellow to red (expensive); the scale tops out at the 99th
+// percentile so that a few outliers don't flatten the rest of the image
+inline Image Heatmap(const CostMap& cost) {
+  Image ret(cost.width, cost.height);
+  if (cost.data.empty())
+    return ret;
+  std::vector<float> sorted = cost.data;
+  auto p99 = sorted.begin() + (sorted.size() - 1) * 99 / 100;
+  std::nth_element(sorted.begin(), p99, sorted.end());
+  float hi = std::max(*p99, 1e-6f);
+  // color stops evenly spaced over [0, 1]
+  const std::array<Vec3f, 6> stops{Vec3f{0, 0, 0},     Vec3f{0, 0, 255},
+                                   Vec3f{0, 255, 255}, Vec3f{0, 255, 0},
+                                   Vec3f{255, 255, 0}, Vec3f{255, 0, 0}};
+  constexpr int nsegments = stops.size() - 1;
+  for (size_t i = 0; i < cost.data.size(); ++i) {
+    float x = std::clamp(cost.data[i] / hi, 0.0f, 1.0f) * nsegments;
+    int seg = std::min(static_cast<int>(x), nsegments - 1);
+    Vec3f c = stops[seg] + (stops[seg + 1] - stops[seg]) * (x - seg);
+    ret.data[i] = Vec3u8{static_cast<uint8_t>(c.x), static_cast<uint8_t>(c.y),
+                         static_cast<uint8_t>(c.z)};
+  }
+  return ret;
+}
+
+#endif // RENDER_COST_HPP_
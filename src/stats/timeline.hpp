@@ -0,0 +1,166 @@
+#ifndef TIMELINE_HPP_
+#define TIMELINE_HPP_
+
+// Per-thread timeline of the render phases in Chrome's trace-event
+// format - load the dumped file in about://tracing or ui.perfetto.dev to
+// see which thread ran which tile and where threads sat idle.
+// Only compiled in with -DENABLE_TIMELINE (`make clean && make
+// TIMELINE=1`); otherwise the macros below expand to nothing and their
+// arguments aren't evaluated.
+//
+//   TIMELINE_SCOPE("Lights::Prepare");          // event until end of scope
+//   TIMELINE_SCOPE_ARG("tile", "index", t);     // with an integer argument
+//   TIMELINE_DUMP("timeline.json");             // write all events so far
+//
+// Event and argument names must be string literals - only the pointers
+// are recorded.
+
+#ifdef ENABLE_TIMELINE
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace Timeline {
+
+struct Event {
+  const char* name{nullptr};
+  const char* arg_name{nullptr}; // nullptr - no argument
+  int64_t arg{0};
+  int64_t begin_ns{0}; // since the first event of the process
+  int64_t duration_ns{0};
+};
+
+// the latest events of one thread; only that thread writes to it, so
+// recording takes no lock - once full the oldest events are overwritten
+class Ring {
+public:
+  static constexpr size_t capacity = size_t{1} << 16;
+
+  explicit Ring(int tid) : tid_(tid), events_(capacity) {}
+
+  void Push(const Event& event) {
+    uint64_t head = head_.load(std::memory_order_relaxed);
+    events_[head & (capacity - 1)] = event;
+    head_.store(head + 1, std::memory_order_release);
+  }
+  // oldest first; events pushed while copying may come out torn, so dump
+  // when the traced work is done
+  std::vector<Event> Snapshot() const {
+    uint64_t head = head_.load(std::memory_order_acquire);
+    uint64_t first = head > capacity ? head - capacity : 0;
+    std::vector<Event> ret;
+    ret.reserve(head - first);
+    for (uint64_t i = first; i < head; ++i)
+      ret.push_back(events_[i & (capacity - 1)]);
+    return ret;
+  }
+  int tid() const { return tid_; }
+
+private:
+  int tid_;
+  std::vector<Event> events_;
+  std::atomic<uint64_t> head_{0};
+};
+
+// rings of all threads that recorded something; they outlive their
+// threads so that events of finished pool workers still get dumped
+class Registry {
+public:
+  static Registry& Get() {
+    static Registry registry;
+    return registry;
+  }
+  // the calling thread's ring, registered on its first event
+  Ring& Local() {
+    thread_local Ring* ring = nullptr;
+    if (!ring) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      rings_.push_back(std::make_unique<Ring>(static_cast<int>(rings_.size())));
+      ring = rings_.back().get();
+    }
+    return *ring;
+  }
+  int64_t Now() const {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now() - epoch_)
+        .count();
+  }
+
+  void Dump(const std::string& path) {
+    std::ofstream out(path);
+    if (!out)
+      throw std::runtime_error("ERROR: Could not write to file " + path);
+    std::lock_guard<std::mutex> lock(mutex_);
+    out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+    const char* sep = "";
+    for (const auto& ring : rings_) {
+      out << sep << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+          << "\"tid\": " << ring->tid() << ", \"args\": {\"name\": \"thread "
+          << ring->tid() << "\"}}";
+      sep = ",\n";
+      // complete ("X") events in microseconds
+      for (const auto& e : ring->Snapshot()) {
+        out << sep << "{\"name\": \"" << e.name
+            << "\", \"cat\": \"render\", \"ph\": \"X\", \"pid\": 1, \"tid\": "
+            << ring->tid() << ", \"ts\": " << e.begin_ns / 1000.0
+            << ", \"dur\": " << e.duration_ns / 1000.0;
+        if (e.arg_name)
+          out << ", \"args\": {\"" << e.arg_name << "\": " << e.arg << "}";
+        out << "}";
+      }
+    }
+    out << "\n]}\n";
+  }
+
+private:
+  Registry() : epoch_(std::chrono::steady_clock::now()) {}
+
+  std::chrono::steady_clock::time_point epoch_;
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Ring>> rings_;
+};
+
+// records an event from its construction to its destruction
+class Scope {
+public:
+  explicit Scope(const char* name, const char* arg_name = nullptr,
+                 int64_t arg = 0)
+      : event_{name, arg_name, arg, Registry::Get().Now(), 0} {}
+  ~Scope() {
+    auto& registry = Registry::Get();
+    event_.duration_ns = registry.Now() - event_.begin_ns;
+    registry.Local().Push(event_);
+  }
+  Scope(const Scope&) = delete;
+  Scope& operator=(const Scope&) = delete;
+
+private:
+  Event event_;
+};
+
+} // namespace Timeline
+
+#define TIMELINE_CONCAT_(a, b) a##b
+#define TIMELINE_CONCAT(a, b) TIMELINE_CONCAT_(a, b)
+#define TIMELINE_SCOPE(name) \
+  Timeline::Scope TIMELINE_CONCAT(timeline_scope_, __LINE__)(name)
+#define TIMELINE_SCOPE_ARG(name, arg_name, arg) \
+  Timeline::Scope TIMELINE_CONCAT(timeline_scope_, __LINE__)(name, arg_name, arg)
+#define TIMELINE_DUMP(path) Timeline::Registry::Get().Dump(path)
+
+#else
+
+#define TIMELINE_SCOPE(name) static_cast<void>(0)
+#define TIMELINE_SCOPE_ARG(name, arg_name, arg) static_cast<void>(0)
+#define TIMELINE_DUMP(path) static_cast<void>(0)
+
+#endif // ENABLE_TIMELINE
+
+#endif // TIMELINE_HPP_